@@ -20,7 +20,12 @@
 #ifndef CSC369A3_EXT2_FS_H
 #define CSC369A3_EXT2_FS_H
 
-#define EXT2_BLOCK_SIZE 1024
+#define EXT2_MIN_BLOCK_SIZE 1024
+#define EXT2_MAX_BLOCK_SIZE 4096
+
+/* Read from s_log_block_size when the image is opened */
+extern unsigned int ext2_block_size;
+#define EXT2_BLOCK_SIZE ext2_block_size
 
 /*
  * Structure of the super block
@@ -167,7 +172,7 @@ struct ext2_inode {
 /* #define EXT4_GRP_QUOTA_INO    4 */ /* Group quota inode */
 /* #define EXT2_BOOT_LOADER_INO  5 */ /* Boot loader inode */
 /* #define EXT2_UNDEL_DIR_INO    6 */ /* Undelete directory inode */
-/* #define EXT2_RESIZE_INO       7 */ /* Reserved group descriptors inode */
+#define    EXT2_RESIZE_INO       7    /* Reserved group descriptors inode */
 /* #define EXT2_JOURNAL_INO      8 */ /* Journal inode */
 /* #define EXT2_EXCLUDE_INO      9 */ /* The "exclude" inode, for snapshots */
 /* #define EXT4_REPLICA_INO     10 */ /* Used by non-upstream feature */
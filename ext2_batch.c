@@ -0,0 +1,119 @@
+#define EXT2_NO_MAIN
+#include "ext2_cp.c"
+#include "ext2_ln.c"
+#include "ext2_ls.c"
+#include "ext2_mkdir.c"
+#include "ext2_rm.c"
+#include "ext2_rm_bonus.c"
+#include "ext2_index.c"
+#include "ext2_cat.c"
+
+#define BATCH_MAX_ARGS 8
+
+char *usage = "USAGE: %s [--journal] [--sync=none|range|full] disk [script]\n";
+
+/*
+ * Runs a single command against the already mapped disk
+ */
+int run_command(unsigned char *disk, int argc, char *argv[]) {
+	char *cmd = argv[0];
+
+	if (!strcmp(cmd, "cp") && argc == 3) {
+		return ext2_cp(disk, argv[1], argv[2]);
+
+	} else if (!strcmp(cmd, "cp") && argc == 4 && !strcmp(argv[1], "-r")) {
+		return ext2_cp_tree(disk, argv[2], argv[3]);
+
+	} else if (!strcmp(cmd, "mkdir") && argc == 2) {
+		return ext2_mkdir(disk, argv[1]);
+
+	} else if (!strcmp(cmd, "ln") && argc == 3) {
+		return ext2_ln(disk, argv[1], argv[2], 0);
+
+	} else if (!strcmp(cmd, "ln") && argc == 4 && !strcmp(argv[1], "-s")) {
+		return ext2_ln(disk, argv[2], argv[3], 1);
+
+	} else if (!strcmp(cmd, "rm") && argc == 2) {
+		return ext2_rm(disk, argv[1]);
+
+	} else if (!strcmp(cmd, "rm") && argc == 3 && !strcmp(argv[1], "-r")) {
+		return remove_file_or_dir(disk, argv[2], 1);
+
+	} else if (!strcmp(cmd, "ls") && argc >= 2) {
+		int flags = 0, i;
+		for (i = 1; i < argc - 1 && ls_flags(argv[i], &flags); i++);
+		if (i == argc - 1) return ext2_ls(disk, argv[i], flags);
+
+	} else if (!strcmp(cmd, "index") && argc == 2) {
+		return ext2_index(disk, argv[1]);
+
+	} else if (!strcmp(cmd, "cat") && (argc == 2 || argc == 3)) {
+		return ext2_cat(disk, argv[1], argc == 3 ? argv[2] : NULL);
+	}
+
+	fprintf(stderr, "Unknown command or bad arguments: %s\n", cmd);
+	return EINVAL;
+}
+
+/*
+ * Reads commands line by line, reporting the status of each one
+ */
+int ext2_batch(unsigned char *disk, FILE *script) {
+	char line[4096];
+	char *argv[BATCH_MAX_ARGS];
+	int argc, status, line_no = 0, failed = 0;
+
+	while (fgets(line, sizeof(line), script)) {
+		line_no++;
+
+		// Split into arguments before running, the helpers use strtok too
+		argc = 0;
+		char *token = strtok(line, " \t\r\n");
+		while (token && argc < BATCH_MAX_ARGS) {
+			argv[argc++] = token;
+			token = strtok(NULL, " \t\r\n");
+		}
+
+		// Skip blank lines and comments
+		if (!argc || argv[0][0] == '#') continue;
+
+		status = run_command(disk, argc, argv);
+		ext2_commit();
+		if (status) failed++;
+
+		// Keep ls output and status lines in order
+		fflush(stdout);
+		if (status) {
+			fprintf(stderr, "[%d] %s: %s (%d)\n", line_no, argv[0], strerror(status), status);
+		} else {
+			fprintf(stderr, "[%d] %s: ok\n", line_no, argv[0]);
+		}
+	}
+
+	return failed ? 1 : 0;
+}
+
+int main(int argc, char *argv[]) {
+	argc = image_options(argc, argv);
+	FILE *script = stdin;
+
+	if (argc != 2 && argc != 3) {
+		fprintf(stderr, usage, argv[0]);
+		return 1;
+	}
+
+	// Script from file, or stdin if not given or -
+	if (argc == 3 && strcmp(argv[2], "-") != 0) {
+		script = fopen(argv[2], "r");
+		if (!script) {
+			perror(argv[2]);
+			return ENOENT;
+		}
+	}
+
+	unsigned char *disk = read_image(argv[1], EXT2_ACCESS_WRITE);
+	int res = ext2_batch(disk, script);
+
+	if (script != stdin) fclose(script);
+	return res;
+}
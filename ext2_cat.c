@@ -0,0 +1,158 @@
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <stdio.h>
+#include <unistd.h>
+#include "ext2_welp.h"
+
+#ifndef EXT2_NO_MAIN
+char *usage = "USAGE: %s disk path [dest]\n";
+#endif
+
+#define CAT_IOVS 64
+
+/*
+ * Where the runs of a file are gathered before being written out in one go
+ */
+struct cat_batch {
+	int fd;
+	int positioned;             // pwritev at offset, else writev
+	off_t offset;               // Where the first iov goes
+	size_t bytes;               // Bytes in all iovs
+	int count;
+	struct iovec iov[CAT_IOVS];
+};
+
+/*
+ * Writes out everything in the batch, carrying on after short writes
+ */
+int cat_flush(struct cat_batch *batch) {
+	struct iovec *iov = batch->iov;
+	int count = batch->count;
+	ssize_t res;
+
+	while (count) {
+		if (batch->positioned) {
+			res = pwritev(batch->fd, iov, count, batch->offset);
+		} else {
+			res = writev(batch->fd, iov, count);
+		}
+		if (res < 0 && errno == EINTR) continue;
+		if (res < 0) return errno;
+		batch->offset += res;
+
+		// Skip what got written
+		while (count && (size_t)res >= iov->iov_len) {
+			res -= iov->iov_len;
+			iov++;
+			count--;
+		}
+		if (count) {
+			iov->iov_base = (char *)iov->iov_base + res;
+			iov->iov_len -= res;
+		}
+	}
+
+	batch->bytes = 0;
+	batch->count = 0;
+	return 0;
+}
+
+/*
+ * Adds size bytes at offset to the batch, writing it out first if full or if
+ * the bytes don't follow on from it
+ */
+int cat_add(struct cat_batch *batch, void *data, size_t size, off_t offset) {
+	int res;
+	if (batch->count == CAT_IOVS || (batch->count && batch->offset + (off_t)batch->bytes != offset)) {
+		if ((res = cat_flush(batch))) return res;
+	}
+
+	if (!batch->count) batch->offset = offset;
+	batch->iov[batch->count].iov_base = data;
+	batch->iov[batch->count].iov_len = size;
+	batch->count++;
+	batch->bytes += size;
+	return 0;
+}
+
+/*
+ * Writes a file in the image out to dest, or stdout if NULL. Runs of blocks go
+ * straight from the mapping, and holes stay holes in a host file
+ */
+int ext2_cat(unsigned char *disk, char *path, char *dest) {
+	static unsigned char zeros[EXT2_MAX_BLOCK_SIZE];
+	struct ext2_block_walk walk;
+	struct cat_batch batch;
+	unsigned int logical, physical, len;
+	int res = 0;
+
+	struct ext2_dir_entry_2 *entry = navigate(disk, path);
+	if (!entry) {
+		fprintf(stderr, "No such file or directory\n");
+		return ENOENT;
+	}
+	if (EXT2_IS_DIRECTORY(entry)) {
+		fprintf(stderr, "%s is a directory\n", path);
+		return EISDIR;
+	}
+
+	batch.fd = STDOUT_FILENO;
+	batch.positioned = 0;
+	batch.bytes = 0;
+	batch.count = 0;
+	if (dest) {
+		batch.fd = open(dest, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		batch.positioned = 1;
+		if (batch.fd < 0) {
+			perror(dest);
+			return EIO;
+		}
+	} else {
+		// Anything already in stdio has to go first
+		fflush(stdout);
+	}
+
+	// A fast symlink's target is in the inode, with no blocks to walk
+	struct ext2_inode *inode = get_inode(disk, entry->inode);
+	if (EXT2_IS_FAST_LINK(inode)) res = cat_add(&batch, inode->i_block, MIN(inode->i_size, EXT2_FAST_LINK_MAX), 0);
+
+	block_walk_init(&walk, disk, inode, 0);
+	while (!res && block_walk_next(&walk, &logical, &physical, &len)) {
+		off_t offset = (off_t)logical * EXT2_BLOCK_SIZE;
+		size_t size = MIN((uint64_t)len * EXT2_BLOCK_SIZE, inode->i_size - (uint64_t)offset);
+
+		if (physical) {
+			res = cat_add(&batch, EXT2_BLOCK(disk, physical), size, offset);
+
+		// Holes read as zeros, a host file just skips over them
+		} else if (!dest) {
+			for (; !res && size; offset += EXT2_BLOCK_SIZE) {
+				res = cat_add(&batch, zeros, MIN(size, EXT2_BLOCK_SIZE), offset);
+				size -= MIN(size, EXT2_BLOCK_SIZE);
+			}
+		}
+	}
+	if (!res) res = cat_flush(&batch);
+
+	// A hole at the end still counts towards the size
+	if (!res && dest && ftruncate(batch.fd, inode->i_size)) res = errno;
+
+	if (res) {
+		fprintf(stderr, "%s: %s\n", dest ? dest : "stdout", strerror(res));
+	}
+	if (dest) close(batch.fd);
+	return res;
+}
+
+#ifndef EXT2_NO_MAIN
+int main(int argc, char *argv[]) {
+	argc = image_options(argc, argv);
+	if (argc == 3 || argc == 4) {
+		unsigned char *disk = open_image(argv[1], EXT2_MAP_SEQUENTIAL, EXT2_ACCESS_READ);
+		return ext2_cat(disk, argv[2], argc == 4 ? argv[3] : NULL);
+	}
+
+	fprintf(stderr, usage, argv[0]);
+	return 1;
+}
+#endif
@@ -1,11 +1,203 @@
+#define _GNU_SOURCE             // SEEK_DATA and SEEK_HOLE
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <dirent.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <time.h>
+#include <unistd.h>
 #include "ext2_welp.h"
 
-char *usage = "USAGE: %s disk src dest\n";
+#ifndef EXT2_NO_MAIN
+char *usage = "USAGE: %s [--journal] [--sync=none|range|full] disk [-r] src dest\n";
+#endif
+
+#define CP_MAX_READERS 8
+#define CP_READ_MAX (1 << 20)           // Files up to this big are read ahead into memory
+#define CP_BUFFERED_MAX (64 << 20)      // Readers wait while this much is waiting to be written
+#define CP_OPEN_MAX 16                  // or while this many big files are open for the writer
+
+/*
+ * Where a file's content comes from
+ */
+struct cp_source {
+	int fd;                     // Read with pread, unless
+	FILE *stream;               // it isn't a regular file,
+	unsigned char *data;        // or it's already been read into memory
+	uint64_t size;              // Bytes in the file, or in data
+	int regular;                // Size is known up front
+};
+
+/*
+ * Reads up to size bytes of the source at offset straight into the image. Files
+ * are read with pread, so the only copy is the kernel's. Pipes and the like go
+ * through stdio. Returns how much was read, short only at the end
+ */
+size_t copy_in(struct cp_source *source, unsigned char *dest, size_t size, off_t offset) {
+	size_t got = 0;
+	ssize_t res;
+
+	if (source->data) {
+		if ((uint64_t)offset >= source->size) return 0;
+		got = MIN(size, source->size - offset);
+		memcpy(dest, source->data + offset, got);
+		return got;
+	}
+	if (source->stream) return fread(dest, 1, size, source->stream);
+
+	while (got < size) {
+		res = pread(source->fd, dest + got, size - got, offset + got);
+		if (res < 0 && errno == EINTR) continue;
+		if (res <= 0) break;
+		got += res;
+	}
+	return got;
+}
+
+/*
+ * Whether a block is all zeros. Eight words are or'd together between each
+ * test, with no branch in between, so the compiler can do it in vector registers
+ */
+int zero_block(const unsigned char *block) {
+	const uint64_t *word = (const uint64_t *)block;
+	unsigned int i, j;
+
+	for (i = 0; i < EXT2_BLOCK_SIZE / sizeof(uint64_t); i += 8) {
+		uint64_t any = 0;
+		for (j = 0; j < 8; j++) any |= word[i + j];
+		if (any) return 0;
+	}
+	return 1;
+}
+
+/*
+ * Finds the first block at or after i with data in it, skipping over the holes
+ * of a sparse source, and sets end to the block after that data. Sources that
+ * can't say where their holes are are all data. Returns count if there's only
+ * holes left
+ */
+unsigned int next_data(struct cp_source *source, unsigned int i, unsigned int count, unsigned int *end) {
+	off_t data, hole;
+
+	*end = count;
+	if (source->data || source->stream) return i;
+
+	data = lseek(source->fd, (off_t)i * EXT2_BLOCK_SIZE, SEEK_DATA);
+	if (data < 0) return errno == ENXIO ? count : i;
+
+	hole = lseek(source->fd, data, SEEK_HOLE);
+	if (hole >= 0) *end = MIN(count, (hole + EXT2_BLOCK_SIZE - 1) / EXT2_BLOCK_SIZE);
+	return data / EXT2_BLOCK_SIZE;
+}
+
+/*
+ * Fills an empty file with everything in source. Holes in the source, and
+ * blocks that are all zeros, are left unmapped. Returns ENOSPC if it didn't
+ * all fit
+ */
+int copy_blocks(unsigned char *disk, unsigned int number, struct cp_source *source) {
+	struct ext2_inode *inode = get_inode(disk, number);
+
+	// A run of blocks at a time, each within one table of block numbers so the
+	// indirect block mapping it comes right before. Streams go until they end
+	unsigned int count = source->regular ? (source->size + EXT2_BLOCK_SIZE - 1) / EXT2_BLOCK_SIZE : UINT32_MAX / EXT2_BLOCK_SIZE;
+	unsigned int i = 0, j, k, len, used, first, slots, end = 0, spare = 0;
+	uint64_t size = 0;
+	int start = 0, done = 0;
+
+	memset(inode->i_block, 0, sizeof(inode->i_block));
+	EXT2_SET_BLOCKS(inode, 0);
+	while (i < count && !done) {
+		if (i >= end && (i = next_data(source, i, count, &end)) >= count) {
+			size = source->size;
+			break;
+		}
+
+		unsigned int *table = get_block_table(disk, inode, i, 1, &first, &slots);
+		if (!table) break;
+
+		// Reserve as many blocks in a row as we can, unless some of the last run is left
+		if (!spare) {
+			start = get_free_run(disk, inode_group(disk, number), MIN(end - i, first + slots - i), &spare);
+			if (start < 0) break;
+			set_block_run(disk, start, spare, 1);
+		}
+		len = MIN(spare, MIN(end - i, first + slots - i));
+
+		// Fill the run with one read
+		unsigned char *run = EXT2_BLOCK(disk, start);
+		size_t got = copy_in(source, run, (size_t)len * EXT2_BLOCK_SIZE, (off_t)i * EXT2_BLOCK_SIZE);
+		used = (got + EXT2_BLOCK_SIZE - 1) / EXT2_BLOCK_SIZE;
+		memset(run + got, '\0', (size_t)used * EXT2_BLOCK_SIZE - got);
+		done = used < len;
+
+		// Blocks of zeros stay holes, and the rest close up behind them so what's
+		// left of the run is still in one piece for the next read
+		mark_dirty(disk, &table[i - first], used * sizeof(*table));
+		for (j = k = 0; j < used; j++) {
+			unsigned char *block = run + (size_t)j * EXT2_BLOCK_SIZE;
+			if (zero_block(block)) {
+				table[i + j - first] = 0;
+				continue;
+			}
+			if (k < j) memcpy(run + (size_t)k * EXT2_BLOCK_SIZE, block, EXT2_BLOCK_SIZE);
+			table[i + j - first] = start + k++;
+		}
+		EXT2_SET_BLOCKS(inode, EXT2_NUM_BLOCKS(disk, inode) + k);
+		mark_data(disk, start, k);
+
+		start += k;
+		spare -= k;
+		size = (uint64_t)i * EXT2_BLOCK_SIZE + got;
+		i += used;
+	}
+
+	// Hand back what the source didn't need
+	if (spare) set_block_run(disk, start, spare, 0);
+	inode->i_size = size;
+	mark_inode(disk, inode);
+
+	return (source->regular ? size < source->size : !done) ? ENOSPC : 0;
+}
+
+/*
+ * Empties a file to be copied over
+ */
+void cp_reset(unsigned char *disk, struct ext2_dir_entry_2 *entry) {
+	struct ext2_inode *inode = get_inode(disk, entry->inode);
+	free_blocks(disk, entry->inode);
+	inode->i_atime = time(0);
+	inode->i_mtime = time(0);
+
+	// Freed blocks are only free once committed, and the copy may need them back
+	ext2_commit();
+}
+
+/*
+ * Gets the file called name in dir ready to be copied into, emptying it if it's
+ * there already, else making it. Returns NULL if it's there as something else
+ */
+struct ext2_dir_entry_2 *cp_target(unsigned char *disk, struct ext2_dir_entry_2 *dir, char *name) {
+	struct ext2_dir_entry_2 *entry = find_file(disk, dir->inode, name);
+	if (entry) {
+		if (!EXT2_IS_FILE(entry)) return NULL;
+		cp_reset(disk, entry);
+		return entry;
+	}
+
+	// Get new inode
+	entry = add_thing(disk, dir, name, EXT2_FT_REG_FILE);
+	struct ext2_inode *inode = get_inode(disk, entry->inode);
+
+	// Setup inode
+	inode->i_mode = EXT2_S_IFREG;
+	inode->i_links_count = 1;
+	inode->i_ctime = time(0);
+	inode->i_atime = time(0);
+	inode->i_mtime = time(0);
+	return entry;
+}
 
 int ext2_cp(unsigned char *disk, char *src, char *dest) {
 	// Check source
@@ -14,7 +206,7 @@ int ext2_cp(unsigned char *disk, char *src, char *dest) {
 		fprintf(stderr, "Source file does not exist\n");
 		return ENOENT;
 	}
-	
+
 	if (S_ISDIR(sb.st_mode)) {
 		fprintf(stderr, "Source is a directory\n");
 		return EISDIR;
@@ -34,82 +226,325 @@ int ext2_cp(unsigned char *disk, char *src, char *dest) {
 		free(dir);
 	}
 
-	char *name = get_filename(src);
+	// Up to triple indirect blocks, and what fits in i_size
+	struct cp_source source = { -1, NULL, NULL, sb.st_size, S_ISREG(sb.st_mode) };
+	if (source.regular && (uint64_t)sb.st_size > MIN(EXT2_MAX_BLOCKS * EXT2_BLOCK_SIZE, UINT32_MAX)) {
+		fprintf(stderr, "Source file is too large\n");
+		return EFBIG;
+	}
 
-	// Check if file exist, if so overwrite
-	if (EXT2_IS_DIRECTORY(entry)) {
-		struct ext2_dir_entry_2 *_entry = find_file(disk, get_inode(disk, entry->inode), name);
-		if (_entry) entry = _entry;
+	// Open file, anything that isn't a regular file is read as a stream
+	source.fd = open(src, O_RDONLY);
+	if (source.fd < 0 || (!source.regular && !(source.stream = fdopen(source.fd, "r")))) {
+		perror(src);
+		if (source.fd >= 0) close(source.fd);
+		return EIO;
 	}
+	if (source.regular) posix_fadvise(source.fd, 0, 0, POSIX_FADV_SEQUENTIAL);
 
-	// Open file
-	FILE *file = fopen(src, "r");
-	assert(file);
+	// Into the directory under the same name, or over the file given
+	char *name = get_filename(src);
+	if (EXT2_IS_DIRECTORY(entry)) {
+		entry = cp_target(disk, entry, name);
+	} else if (EXT2_IS_FILE(entry)) {
+		cp_reset(disk, entry);
+	} else {
+		entry = NULL;
+	}
+	free(name);
 
-	struct ext2_inode *inode = get_inode(disk, entry->inode);
-	if (EXT2_IS_FILE(entry)) {
-		// Clean entry
-		free_blocks(disk, entry->inode);
+	int res = entry ? copy_blocks(disk, entry->inode, &source) : EEXIST;
+	if (source.stream) {
+		fclose(source.stream);
 	} else {
-		// Get new inode
-		entry = add_thing(disk, entry, name, EXT2_FT_REG_FILE);
-		inode = get_inode(disk, entry->inode);
+		close(source.fd);
+	}
 
-		// Setup inode
-		inode->i_mode = EXT2_S_IFREG;
-		inode->i_links_count = 1;
-		inode->i_ctime = time(0);
+	if (res == EEXIST) {
+		fprintf(stderr, "%s exists and is not a file\n", dest);
+	} else if (res) {
+		fprintf(stderr, "No space left on disk\n");
 	}
+	return res;
+}
 
-	// Set information
-	inode->i_size = sb.st_size;
-	inode->i_atime = time(0);
-	inode->i_mtime = time(0);
+/*
+ * A host file or directory to copy in, in the order they're made
+ */
+struct cp_item {
+	char *path;                 // On the host
+	char *name;                 // In the image
+	int parent;                 // Item of the directory it goes in, -1 for dest
+	int is_dir;
+	unsigned int inode;         // Of a directory once made, 0 if it couldn't be
+	int ready;                  // Read, or opened, by a reader
+	int error;                  // errno if the reader couldn't open it
+	struct cp_source source;
+};
+
+/*
+ * A tree copy. Readers go through the files ahead of the writer, reading small
+ * ones into memory and opening big ones. The writer (the calling thread) makes
+ * everything in the image in order, so it's the only one touching it
+ */
+struct cp_job {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct cp_item *items;
+	int count;
+	int size;
+	int next;                   // Next item for the readers
+	size_t buffered;            // Bytes read, or being read ahead, but not written yet
+	int opened;                 // Big files left open for the writer
+};
 
-	char *buff = (char *)malloc(EXT2_BLOCK_SIZE);
-	int block_index, i = 0;
+int cp_push(struct cp_job *job, char *path, char *name, int parent, int is_dir) {
+	if (job->count == job->size) {
+		job->size = job->size ? job->size * 2 : 256;
+		job->items = realloc(job->items, job->size * sizeof(struct cp_item));
+		assert(job->items);
+	}
 
-	while (fread(buff, 1, EXT2_BLOCK_SIZE, file)) {
-		block_index = get_free_block(disk);
-		set_block_bitmap(disk, block_index, 1);
+	struct cp_item *item = &job->items[job->count];
+	memset(item, 0, sizeof(*item));
+	item->path = path;
+	item->name = name;
+	item->parent = parent;
+	item->is_dir = is_dir;
+	item->source.fd = -1;
+	return job->count++;
+}
 
-		memcpy(EXT2_BLOCK(disk, block_index), buff, EXT2_BLOCK_SIZE);
+/*
+ * Lists a host directory and everything under it, each directory before what's in it
+ */
+void cp_walk(struct cp_job *job, char *path, int parent) {
+	struct dirent *dirent;
+	struct stat sb;
+	DIR *dir = opendir(path);
+	if (!dir) {
+		perror(path);
+		return;
+	}
 
-		// Add to direct
-		if (i < EXT2_DIRECT_BLOCKS) {
-			inode->i_block[i] = block_index;
-		
-		// Add to indirect
-		} else {
+	while ((dirent = readdir(dir))) {
+		char *name = dirent->d_name;
+		if (!strcmp(name, ".") || !strcmp(name, "..")) continue;
 
-			// Init indirect
-			if (i == EXT2_DIRECT_BLOCKS) {
-				int indirect = get_free_block(disk);
-				set_block_bitmap(disk, indirect, 1);
-				inode->i_block[EXT2_DIRECT_BLOCKS] = indirect;
-			}
+		char *child = malloc(strlen(path) + strlen(name) + 2);
+		assert(child);
+		sprintf(child, "%s/%s", path, name);
 
-			int *indirect_block = (int *)EXT2_BLOCK(disk, inode->i_block[EXT2_DIRECT_BLOCKS]);
-			indirect_block[i - EXT2_DIRECT_BLOCKS] = block_index;
+		if (strlen(name) > EXT2_NAME_LEN || lstat(child, &sb) || !(S_ISDIR(sb.st_mode) || S_ISREG(sb.st_mode))) {
+			fprintf(stderr, "Skipping %s\n", child);
+			free(child);
+			continue;
 		}
 
-		i++;
+		int item = cp_push(job, child, strdup(name), parent, S_ISDIR(sb.st_mode));
+		if (S_ISDIR(sb.st_mode)) cp_walk(job, child, item);
 	}
+	closedir(dir);
+}
 
-	EXT2_SET_BLOCKS(inode, MIN(i, EXT2_DIRECT_BLOCKS + 1));
-	free(buff);
-	free(name);
+/*
+ * Gets a file ready for the writer, all of it in memory if it's small
+ */
+void cp_read(struct cp_item *item) {
+	struct cp_source *source = &item->source;
+	struct stat sb;
+
+	// errno is the reader's own, so it's kept for the writer to report
+	source->fd = open(item->path, O_RDONLY);
+	if (source->fd < 0 || fstat(source->fd, &sb)) {
+		item->error = errno;
+		if (source->fd >= 0) close(source->fd);
+		source->fd = -1;
+		return;
+	}
+	source->size = sb.st_size;
+	source->regular = 1;
+
+	if (sb.st_size > CP_READ_MAX) {
+		posix_fadvise(source->fd, 0, 0, POSIX_FADV_WILLNEED);
+		return;
+	}
+
+	struct cp_source file = *source;
+	source->data = malloc(sb.st_size + 1);
+	assert(source->data);
+	source->size = copy_in(&file, source->data, sb.st_size, 0);
+	close(source->fd);
+	source->fd = -1;
+}
+
+void *cp_reader(void *arg) {
+	struct cp_job *job = arg;
+	int i;
+
+	pthread_mutex_lock(&job->lock);
+	while (1) {
+		// Taken in order, so whatever the writer waits on is always being read
+		while ((job->buffered >= CP_BUFFERED_MAX || job->opened >= CP_OPEN_MAX) && job->next < job->count) {
+			pthread_cond_wait(&job->cond, &job->lock);
+		}
+		while (job->next < job->count && job->items[job->next].is_dir) job->next++;
+		if (job->next >= job->count) break;
+		i = job->next++;
+		pthread_mutex_unlock(&job->lock);
+
+		cp_read(&job->items[i]);
+
+		pthread_mutex_lock(&job->lock);
+		job->items[i].ready = 1;
+		if (job->items[i].source.data || job->items[i].source.fd >= 0) job->buffered += job->items[i].source.size;
+		if (job->items[i].source.fd >= 0) job->opened++;
+		pthread_cond_broadcast(&job->cond);
+	}
+	pthread_mutex_unlock(&job->lock);
+	return NULL;
+}
+
+/*
+ * Makes one item in the image, in the directory with inode number parent.
+ * Entries move about as directories get indexed, so only numbers are kept
+ */
+int cp_write(unsigned char *disk, struct cp_item *item, unsigned int parent) {
+	struct ext2_dir_entry_2 dir = { parent, 0, 0, EXT2_FT_DIR };
+	struct ext2_dir_entry_2 *entry = find_file(disk, parent, item->name);
+
+	if (item->is_dir) {
+		if (entry && !EXT2_IS_DIRECTORY(entry)) {
+			fprintf(stderr, "%s exists and is not a directory\n", item->name);
+			return EEXIST;
+		}
+		item->inode = (entry ? entry : add_dir(disk, &dir, item->name))->inode;
+		return 0;
+	}
+
+	if (item->source.fd < 0 && !item->source.data) {
+		fprintf(stderr, "%s: %s\n", item->path, strerror(item->error));
+		return EIO;
+	}
+	if (item->source.size > MIN(EXT2_MAX_BLOCKS * EXT2_BLOCK_SIZE, UINT32_MAX)) {
+		fprintf(stderr, "%s is too large\n", item->path);
+		return EFBIG;
+	}
+	entry = cp_target(disk, &dir, item->name);
+	if (!entry) {
+		fprintf(stderr, "%s exists and is not a file\n", item->name);
+		return EEXIST;
+	}
+	if (copy_blocks(disk, entry->inode, &item->source)) {
+		fprintf(stderr, "No space left on disk\n");
+		return ENOSPC;
+	}
 	return 0;
 }
 
+/*
+ * Copies a host directory and everything in it into dest, as dest if it doesn't
+ * exist yet, else into it under the same name
+ */
+int ext2_cp_tree(unsigned char *disk, char *src, char *dest) {
+	struct stat sb;
+	if (stat(src, &sb)) {
+		fprintf(stderr, "Source file does not exist\n");
+		return ENOENT;
+	}
+	if (!S_ISDIR(sb.st_mode)) return ext2_cp(disk, src, dest);
+
+	// Where it goes
+	struct ext2_dir_entry_2 *entry = navigate(disk, dest);
+	char *name;
+	if (entry) {
+		name = get_filename(src);
+	} else {
+		char *dir = get_dir(dest);
+		entry = navigate(disk, dir);
+		free(dir);
+		name = get_filename(dest);
+	}
+	if (!EXT2_IS_DIRECTORY(entry)) {
+		fprintf(stderr, "%s is not a directory\n", dest);
+		free(name);
+		return ENOTDIR;
+	}
+
+	struct cp_job job;
+	memset(&job, 0, sizeof(job));
+	pthread_mutex_init(&job.lock, NULL);
+	pthread_cond_init(&job.cond, NULL);
+	cp_push(&job, strdup(src), name, -1, 1);
+	cp_walk(&job, src, 0);
+
+	pthread_t readers[CP_MAX_READERS];
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int count = MAX(1, MIN(cpus, CP_MAX_READERS)), started, i, res = 0;
+	for (started = 0; started < count; started++) {
+		if (pthread_create(&readers[started], NULL, cp_reader, &job)) break;
+	}
+	if (!started) cp_reader(&job);
+
+	// Make everything in order, waiting for files to be read, until out of space
+	for (i = 0; i < job.count && res != ENOSPC; i++) {
+		struct cp_item *item = &job.items[i];
+		unsigned int parent = item->parent < 0 ? entry->inode : job.items[item->parent].inode;
+
+		pthread_mutex_lock(&job.lock);
+		while (!item->is_dir && !item->ready) {
+			pthread_cond_wait(&job.cond, &job.lock);
+		}
+		pthread_mutex_unlock(&job.lock);
+
+		// Nothing goes in a directory that couldn't be made
+		int err = parent ? cp_write(disk, item, parent) : 0;
+		if (err && (!res || err == ENOSPC)) res = err;
+
+		pthread_mutex_lock(&job.lock);
+		if (err == ENOSPC) job.next = job.count;
+		if (item->source.data || item->source.fd >= 0) job.buffered -= item->source.size;
+		if (item->source.fd >= 0) job.opened--;
+		pthread_cond_broadcast(&job.cond);
+		pthread_mutex_unlock(&job.lock);
+
+		free(item->source.data);
+		item->source.data = NULL;
+		if (item->source.fd >= 0) close(item->source.fd);
+		item->source.fd = -1;
+	}
+
+	// Readers may have got further than the writer
+	for (i = 0; i < started; i++) {
+		pthread_join(readers[i], NULL);
+	}
+	for (i = 0; i < job.count; i++) {
+		if (job.items[i].source.fd >= 0) close(job.items[i].source.fd);
+		free(job.items[i].source.data);
+		free(job.items[i].path);
+		free(job.items[i].name);
+	}
+	free(job.items);
+	pthread_mutex_destroy(&job.lock);
+	pthread_cond_destroy(&job.cond);
+	return res;
+}
+
+#ifndef EXT2_NO_MAIN
 int main(int argc, char *argv[]) {
-	// Check args
-	if (argc != 4) {
-		fprintf(stderr, usage, argv[0]);
-		return 1;
+	argc = image_options(argc, argv);
+	unsigned char *disk;
+
+	if (argc == 4) {
+		disk = open_image(argv[1], EXT2_MAP_SEQUENTIAL, EXT2_ACCESS_WRITE);
+		return ext2_cp(disk, argv[2], argv[3]);
+
+	} else if (argc == 5 && !strcmp(argv[2], "-r")) {
+		disk = open_image(argv[1], EXT2_MAP_SEQUENTIAL, EXT2_ACCESS_WRITE);
+		return ext2_cp_tree(disk, argv[3], argv[4]);
 	}
 
-	// Read disk
-	unsigned char *disk = read_image(argv[1]);
-	return ext2_cp(disk, argv[2], argv[3]);
-}
\ No newline at end of file
+	fprintf(stderr, usage, argv[0]);
+	return 1;
+}
+#endif
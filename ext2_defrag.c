@@ -0,0 +1,305 @@
+#include <assert.h>
+#include <stdio.h>
+#include <errno.h>
+#include "ext2.h"
+#include "ext2_welp.h"
+
+char *usage = "USAGE: %s [--journal] [--sync=none|range|full] disk [-dp]\n";
+
+#define DEFRAG_DIRS 1       // -d: compact directories first
+#define DEFRAG_PACK 2       // -p: fill the holes at the front from the back, then join what's left in pieces
+#define DEFRAG_ALL 4        // Move files already in one piece too, when packing
+
+struct defrag_stats {
+	unsigned int files;         // Moved
+	unsigned int blocks;        // In them
+	unsigned int dirs;          // Compacted
+	unsigned int saved;         // Blocks that freed
+	unsigned int skipped;       // Still in pieces, no run long enough for them
+};
+
+/*
+ * Slot for logical block n in a block map being built, making the indirect
+ * blocks on the way out of next. The run they come out of ends at end.
+ * Returns NULL if it would go past it
+ */
+unsigned int *defrag_slot(unsigned char *disk, unsigned int *map, unsigned int n, unsigned int *next, unsigned int end) {
+	unsigned int per = EXT2_INDIRECT_BLOCKS, depth = 1, *slot;
+	uint64_t span = per, rel = n - EXT2_DIRECT_BLOCKS;
+	if (n < EXT2_DIRECT_BLOCKS) return &map[n];
+
+	// Which tree it's in, and where in it
+	while (rel >= span) {
+		rel -= span;
+		span *= per;
+		depth++;
+	}
+	slot = &map[EXT2_DIRECT_BLOCKS + depth - 1];
+
+	for (; depth; depth--) {
+		span /= per;
+		if (!*slot) {
+			if (*next >= end) return NULL;
+			*slot = (*next)++;
+			memset(EXT2_BLOCK(disk, *slot), 0, EXT2_BLOCK_SIZE);
+		}
+		unsigned int *table = (unsigned int *)EXT2_BLOCK(disk, *slot);
+		mark_dirty(disk, table, EXT2_BLOCK_SIZE);
+		slot = &table[(rel / span) % per];
+	}
+	return slot;
+}
+
+/*
+ * Moves an inode's blocks into one run, data in order with each indirect
+ * block just before the first block it maps, as a fresh copy would be. The
+ * old blocks are freed once the new ones are all filled in. With pack, goes
+ * for the first hole it fits in, and only if that's closer to the front than
+ * it is now. Only files in pieces move, unless all is set. Returns 1 if it moved
+ */
+int defrag_inode(unsigned char *disk, unsigned int number, int flags, struct defrag_stats *stats) {
+	struct ext2_inode *inode = get_inode(disk, number);
+	unsigned int total = EXT2_NUM_BLOCKS(disk, inode), blocks, first, len, next, logical, physical, run;
+	unsigned int map[EXT2_DIRECT_BLOCKS + 3] = {0};
+	int is_dir = (inode->i_mode & 0xF000) == EXT2_S_IFDIR;
+	struct ext2_block_walk walk;
+	int start;
+
+	int fragments = file_fragments(disk, inode, &blocks);
+	if (!total || !fragments || (fragments < 2 && !(flags & DEFRAG_ALL))) return 0;
+
+	// Pack goes for the first run it fits in from the front, else stays near its inode
+	if (flags & DEFRAG_PACK) {
+		unsigned int groups = EXT2_GROUP_COUNT(disk), group;
+		for (group = 0; group < groups; group++) {
+			get_block_bitmap(disk, group)->cursor = 0;
+		}
+	}
+	start = get_free_run(disk, (flags & DEFRAG_PACK) ? 0 : inode_group(disk, number), total, &len);
+	if (start < 0 || len < total) return 0;
+
+	// Packing doesn't move anything further back
+	first = 0;
+	block_walk_init(&walk, disk, inode, 0);
+	walk.limit = ~0U;
+	while (!first && block_walk_next(&walk, &logical, &physical, &run)) first = physical;
+	if ((flags & DEFRAG_PACK) && (unsigned int)start >= first) return 0;
+
+	set_block_run(disk, start, total, 1);
+
+	// Copy into the new run, everything that's mapped whatever i_size says
+	next = start;
+	block_walk_init(&walk, disk, inode, 0);
+	walk.limit = ~0U;
+	while (block_walk_next(&walk, &logical, &physical, &run)) {
+		for (; physical && run; logical++, physical++, run--) {
+			unsigned int *slot = defrag_slot(disk, map, logical, &next, start + total);
+			if (!slot || next >= start + total) {
+				// More than i_blocks said, so leave it where it is
+				fprintf(stderr, "Inode %u: block count is off, run ext2_fsck\n", number);
+				set_block_run(disk, start, total, 0);
+				return 0;
+			}
+
+			*slot = next++;
+			memcpy(EXT2_BLOCK(disk, *slot), EXT2_BLOCK(disk, physical), EXT2_BLOCK_SIZE);
+			if (is_dir) mark_dirty(disk, EXT2_BLOCK(disk, *slot), EXT2_BLOCK_SIZE);
+			else mark_data(disk, *slot, 1);
+		}
+	}
+
+	// Then swap the maps over, and give back the old blocks and any of the run not needed
+	release_blocks(disk, inode, 0, free_block_run, NULL);
+	if (next < (unsigned int)start + total) set_block_run(disk, next, start + total - next, 0);
+	memcpy(inode->i_block, map, sizeof(map));
+	EXT2_SET_BLOCKS(inode, next - start);
+	mark_inode(disk, inode);
+
+	if (is_dir) dcache_flush();
+	stats->files++;
+	stats->blocks += next - start;
+	return 1;
+}
+
+/*
+ * Lays out entries copied from a directory end to end, each block's last entry
+ * taking up the rest of it. Writes them into the directory's blocks if write
+ * is set. Returns the number of blocks they take
+ */
+unsigned int pack_entries(unsigned char *disk, struct ext2_inode *inode, unsigned char *copy, unsigned int blocks, int write) {
+	struct ext2_dir_entry_2 *entry, *last = NULL;
+	unsigned int used = 1, pos = 0, size, i;
+	unsigned char *block = write ? EXT2_BLOCK(disk, get_block_number(disk, inode, 0)) : NULL;
+	struct ext2_dir_iter it;
+
+	for (i = 0; i < blocks; i++) {
+		dir_iter_block(&it, copy + i * EXT2_BLOCK_SIZE);
+		while ((entry = dir_iter_next(&it))) {
+			if (!entry->inode) continue;
+			size = EXT2_ENTRY_SIZE(entry);
+
+			if (pos + size > EXT2_BLOCK_SIZE) {
+				if (write) {
+					last->rec_len += EXT2_BLOCK_SIZE - pos;
+					mark_dirty(disk, block, EXT2_BLOCK_SIZE);
+					block = EXT2_BLOCK(disk, get_block_number(disk, inode, used));
+				}
+				used++;
+				pos = 0;
+			}
+
+			if (write) {
+				last = (struct ext2_dir_entry_2 *)(block + pos);
+				memcpy(last, entry, size);
+				last->rec_len = size;
+			}
+			pos += size;
+		}
+	}
+
+	if (write && last) {
+		last->rec_len += EXT2_BLOCK_SIZE - pos;
+		mark_dirty(disk, block, EXT2_BLOCK_SIZE);
+	}
+	return used;
+}
+
+/*
+ * Squeezes out the space deleted entries left in a directory, and gives back
+ * the blocks that frees up. Indexed directories are rebuilt instead, which
+ * packs their leaves. Returns the blocks saved
+ */
+unsigned int compact_dir(unsigned char *disk, struct ext2_inode *inode) {
+	unsigned int blocks = EXT2_DIR_BLOCKS(inode), live = 0, used, i;
+	struct ext2_dir_entry_2 *entry;
+	struct ext2_dir_iter it;
+
+	if (blocks < 2) return 0;
+
+	if (dx_is_indexed(disk, inode)) {
+		dir_iter_init(&it, disk, inode);
+		while ((entry = dir_iter_next(&it))) {
+			if (entry->inode) live += EXT2_ENTRY_SIZE(entry);
+		}
+		if (1 + (live + DX_LEAF_FILL - 1) / DX_LEAF_FILL >= blocks || dx_build(disk, inode)) return 0;
+		return blocks - MIN(blocks, EXT2_DIR_BLOCKS(inode));
+	}
+
+	// Entries move about, so they come from a copy
+	unsigned char *copy = malloc((size_t)blocks * EXT2_BLOCK_SIZE);
+	assert(copy);
+	for (i = 0; i < blocks; i++) {
+		memcpy(copy + i * EXT2_BLOCK_SIZE, EXT2_BLOCK(disk, get_block_number(disk, inode, i)), EXT2_BLOCK_SIZE);
+	}
+
+	used = pack_entries(disk, inode, copy, blocks, 0);
+	if (used < blocks) {
+		pack_entries(disk, inode, copy, blocks, 1);
+		truncate_dir_blocks(disk, inode, used);
+	}
+	free(copy);
+	return blocks - used;
+}
+
+/*
+ * Inode numbers by where their first block is
+ */
+struct defrag_item {
+	unsigned int first;
+	unsigned int inode;
+};
+
+int defrag_item_cmp(const void *a, const void *b) {
+	const struct defrag_item *x = a, *y = b;
+	return x->first < y->first ? -1 : x->first > y->first;
+}
+
+int ext2_defrag(unsigned char *disk, int flags) {
+	struct ext2_super_block *sb = EXT2_SUPER_BLOCK(disk);
+	struct defrag_item *items = malloc(sb->s_inodes_count * sizeof(struct defrag_item));
+	unsigned int number, count = 0, i, logical, physical, len;
+	struct defrag_stats stats = {0};
+	struct ext2_block_walk walk;
+
+	// lost+found keeps its blocks, so fsck has room without allocating
+	struct ext2_dir_entry_2 *lost = find_file(disk, EXT2_ROOT_INO, "lost+found");
+	unsigned int lost_ino = lost ? lost->inode : 0;
+
+	assert(items);
+	for (number = 1; number <= sb->s_inodes_count; number++) {
+		struct ext2_inode *inode = get_inode(disk, number);
+		if (number < EXT2_FIRST_INO(disk) && number != EXT2_ROOT_INO) continue;
+		if (!inode->i_links_count || !inode->i_blocks) continue;
+
+		if ((flags & DEFRAG_DIRS) && (inode->i_mode & 0xF000) == EXT2_S_IFDIR && number != lost_ino) {
+			unsigned int saved = compact_dir(disk, inode);
+			if (saved) {
+				stats.dirs++;
+				stats.saved += saved;
+			}
+		}
+
+		items[count].inode = number;
+		items[count].first = 0;
+		block_walk_init(&walk, disk, inode, 0);
+		while (!items[count].first && block_walk_next(&walk, &logical, &physical, &len)) items[count].first = physical;
+		count++;
+	}
+	dcache_flush();
+
+	// Freed blocks are only free once committed, and packing wants them back straight away
+	ext2_commit();
+
+	// Last first, so what moves leaves its hole at the back where they all run together
+	if (flags & DEFRAG_PACK) {
+		qsort(items, count, sizeof(struct defrag_item), defrag_item_cmp);
+		for (i = count; i--;) {
+			if (defrag_inode(disk, items[i].inode, DEFRAG_PACK | DEFRAG_ALL, &stats)) ext2_commit();
+		}
+	}
+
+	// Then what's still in pieces, which packing still only moves toward the front
+	for (i = 0; i < count; i++) {
+		if (defrag_inode(disk, items[i].inode, flags & DEFRAG_PACK, &stats) && (flags & DEFRAG_PACK)) ext2_commit();
+	}
+	for (i = 0; i < count; i++) {
+		if (file_fragments(disk, get_inode(disk, items[i].inode), &len) > 1) stats.skipped++;
+	}
+	free(items);
+
+	printf("Moved %u files (%u blocks), compacted %u directories (%u blocks freed)", stats.files, stats.blocks, stats.dirs, stats.saved);
+	if (stats.skipped) printf(", %u left in place for want of space", stats.skipped);
+	printf("\n");
+	return 0;
+}
+
+/*
+ * Reads flags like -dp into flags. Returns 0 if it isn't flags
+ */
+int defrag_flags(char *arg, int *flags) {
+	if (arg[0] != '-' || !arg[1]) return 0;
+
+	for (arg++; *arg; arg++) {
+		if (*arg == 'd') {
+			*flags |= DEFRAG_DIRS;
+		} else if (*arg == 'p') {
+			*flags |= DEFRAG_PACK;
+		} else {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+int main(int argc, char *argv[]) {
+	argc = image_options(argc, argv);
+	int flags = 0;
+
+	if (argc != 2 && !(argc == 3 && defrag_flags(argv[2], &flags))) {
+		fprintf(stderr, usage, argv[0]);
+		return 1;
+	}
+
+	unsigned char *disk = read_image(argv[1], EXT2_ACCESS_WRITE);
+	return ext2_defrag(disk, flags);
+}
@@ -0,0 +1,186 @@
+#include <stdio.h>
+#include <unistd.h>
+#include "ext2.h"
+#include "ext2_welp.h"
+
+char *usage = "USAGE: %s disk [-f]\n";
+
+#define FRAG_BUCKETS 32     // Free extents of 2^i up to 2^(i+1)-1 blocks
+
+/*
+ * What the bitmaps and block maps add up to
+ */
+struct frag_stats {
+	unsigned int free_blocks;
+	unsigned int free_inodes;
+	unsigned int extents;                   // Free extents
+	unsigned int largest;                   // Blocks in the biggest
+	unsigned int run;                       // Length of the one being scanned
+	unsigned int bucket_extents[FRAG_BUCKETS];
+	unsigned int bucket_blocks[FRAG_BUCKETS];
+	unsigned int files;                     // Inodes with blocks
+	unsigned int fragmented;                // In more than one piece
+	unsigned long long fragments;
+};
+
+struct ext2_out out;
+
+void frag_close(struct frag_stats *stats) {
+	if (!stats->run) return;
+	int bucket = 31 - __builtin_clz(stats->run);
+	stats->extents++;
+	stats->largest = MAX(stats->largest, stats->run);
+	stats->bucket_extents[bucket]++;
+	stats->bucket_blocks[bucket] += stats->run;
+	stats->run = 0;
+}
+
+/*
+ * Adds a word of free bits to the extents. Whole words free or in use cost
+ * a compare, otherwise each run of bits in it is found with a count of
+ * trailing zeros, so it's a few instructions per extent and not per block
+ */
+void frag_word(struct frag_stats *stats, uint64_t free) {
+	unsigned int pos = 0, len;
+	uint64_t rest;
+
+	if (!free) {
+		frag_close(stats);
+		return;
+	}
+	stats->free_blocks += __builtin_popcountll(free);
+	if (free == ~0ULL) {
+		stats->run += 64;
+		return;
+	}
+
+	while (pos < 64) {
+		// Free bits carry on the extent
+		rest = ~(free >> pos);
+		len = rest ? __builtin_ctzll(rest) : 64 - pos;
+		stats->run += len;
+		pos += len;
+		if (pos >= 64) break;
+
+		// Then a used one ends it, skip to the next free one
+		frag_close(stats);
+		rest = free >> pos;
+		if (!rest) break;
+		pos += __builtin_ctzll(rest);
+	}
+}
+
+/*
+ * Goes through the block bitmaps a word at a time. Extents carry on from one
+ * group into the next, their blocks are next to each other
+ */
+void frag_bitmaps(unsigned char *disk, struct frag_stats *stats) {
+	struct ext2_super_block *sb = EXT2_SUPER_BLOCK(disk);
+	unsigned int groups = EXT2_GROUP_COUNT(disk), group, bits, w;
+	uint64_t word, mask;
+
+	for (group = 0; group < groups; group++) {
+		struct ext2_group_desc *desc = get_group_desc(disk, group);
+		unsigned char *map = EXT2_BLOCK(disk, desc->bg_block_bitmap);
+
+		// Bits past the end of a short group are in use
+		bits = group_blocks(disk, group);
+		for (w = 0; w < (bits + 63) / 64; w++) {
+			mask = (w + 1) * 64 > bits ? (1ULL << (bits % 64)) - 1 : ~0ULL;
+			memcpy(&word, map + w * 8, sizeof(word));
+			frag_word(stats, ~word & mask);
+		}
+		stats->free_inodes += sb->s_inodes_per_group - bitmap_used(EXT2_BLOCK(disk, desc->bg_inode_bitmap), sb->s_inodes_per_group);
+	}
+	frag_close(stats);
+}
+
+/*
+ * Goes through the inodes in use, found a word of the inode bitmap at a time
+ */
+void frag_files(unsigned char *disk, struct frag_stats *stats) {
+	struct ext2_super_block *sb = EXT2_SUPER_BLOCK(disk);
+	unsigned int groups = EXT2_GROUP_COUNT(disk), group, w, number, fragments, blocks;
+	unsigned int words = (sb->s_inodes_per_group + 63) / 64;
+	uint64_t word;
+
+	for (group = 0; group < groups; group++) {
+		unsigned char *map = EXT2_BLOCK(disk, get_group_desc(disk, group)->bg_inode_bitmap);
+
+		for (w = 0; w < words; w++) {
+			memcpy(&word, map + w * 8, sizeof(word));
+			if (w == words - 1 && sb->s_inodes_per_group % 64) word &= (1ULL << (sb->s_inodes_per_group % 64)) - 1;
+
+			for (; word; word &= word - 1) {
+				number = 1 + group * sb->s_inodes_per_group + w * 64 + __builtin_ctzll(word);
+				if (number < EXT2_FIRST_INO(disk) && number != EXT2_ROOT_INO) continue;
+
+				fragments = file_fragments(disk, get_inode(disk, number), &blocks);
+				if (!fragments) continue;
+				stats->files++;
+				stats->fragments += fragments;
+				if (fragments > 1) stats->fragmented++;
+			}
+		}
+	}
+}
+
+/*
+ * Lists each file in more than one piece, with -f
+ */
+void frag_entry(unsigned char *disk, unsigned int parent, const char *path, struct ext2_dir_entry_2 *entry, void *params) {
+	unsigned int blocks, fragments = file_fragments(disk, get_inode(disk, entry->inode), &blocks);
+	if (fragments > 1) out_printf(&out, "%s: %u fragments, %u blocks\n", path, fragments, blocks);
+}
+
+int ext2_frag(unsigned char *disk, int list) {
+	struct ext2_super_block *sb = EXT2_SUPER_BLOCK(disk);
+	unsigned int blocks = sb->s_blocks_count, i;
+	struct frag_stats stats;
+
+	memset(&stats, 0, sizeof(stats));
+	frag_bitmaps(disk, &stats);
+	frag_files(disk, &stats);
+
+	out_init(&out, STDOUT_FILENO);
+	out_printf(&out, "Blocks: %u used, %u free, %u total (%.1f%% free)\n", blocks - stats.free_blocks,
+		stats.free_blocks, blocks, blocks ? 100.0 * stats.free_blocks / blocks : 0);
+	out_printf(&out, "Inodes: %u used, %u free, %u total\n", sb->s_inodes_count - stats.free_inodes,
+		stats.free_inodes, sb->s_inodes_count);
+	out_printf(&out, "Free extents: %u, largest %u blocks, average %.1f blocks\n", stats.extents,
+		stats.largest, stats.extents ? (double)stats.free_blocks / stats.extents : 0);
+	out_printf(&out, "Files: %u, %u fragmented, %.2f fragments per file\n", stats.files, stats.fragmented,
+		stats.files ? (double)stats.fragments / stats.files : 0);
+
+	out_printf(&out, "\nFree extent sizes:\n%10s %10s %10s %10s %7s\n", "from", "to", "extents", "blocks", "free");
+	for (i = 0; i < FRAG_BUCKETS; i++) {
+		if (!stats.bucket_extents[i]) continue;
+		out_printf(&out, "%10u %10u %10u %10u %6.2f%%\n", 1U << i, (unsigned int)((2ULL << i) - 1),
+			stats.bucket_extents[i], stats.bucket_blocks[i], 100.0 * stats.bucket_blocks[i] / stats.free_blocks);
+	}
+
+	if (list) {
+		out_printf(&out, "\nFragmented files:\n");
+		walk_tree(disk, frag_entry, NULL);
+	}
+	out_flush(&out);
+
+	if (out.error) {
+		fprintf(stderr, "stdout: %s\n", strerror(out.error));
+		return out.error;
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[]) {
+	argc = image_options(argc, argv);
+	int list = argc == 3 && !strcmp(argv[2], "-f");
+
+	if (argc != 2 && !list) {
+		fprintf(stderr, usage, argv[0]);
+		return 1;
+	}
+
+	unsigned char *disk = read_image(argv[1], EXT2_ACCESS_READ);
+	return ext2_frag(disk, list);
+}
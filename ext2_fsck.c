@@ -0,0 +1,379 @@
+#include <assert.h>
+#include <stdio.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "ext2.h"
+#include "ext2_welp.h"
+
+char *usage = "USAGE: %s [--journal] [--sync=none|range|full] disk [-y]\n";
+
+#define FSCK_MAX_WORKERS 8
+#define FSCK_CHUNK 1024         // Inodes handed to a worker at a time
+#define FSCK_MAX_REPORTS 20     // Of each kind, the rest are only counted
+
+// Exit status, like e2fsck
+#define FSCK_OK 0
+#define FSCK_FIXED 1
+#define FSCK_UNFIXED 4
+#define FSCK_USAGE 8
+
+// Kinds of problem
+#define FSCK_BAD_BLOCK 0        // Block number outside the image
+#define FSCK_DUP_BLOCK 1        // Block used twice
+#define FSCK_BAD_ENTRY 2        // Entry for an inode that can't be
+#define FSCK_I_BLOCKS 3         // i_blocks doesn't match the block map
+#define FSCK_LINKS 4            // Link count doesn't match the entries
+#define FSCK_UNATTACHED 5       // In use, in no directory
+#define FSCK_FREE_LINKED 6      // Free, but in a directory
+#define FSCK_BLOCK_BITMAP 7
+#define FSCK_INODE_BITMAP 8
+#define FSCK_COUNTS 9           // Free and directory counts
+#define FSCK_KINDS 10
+
+// Only these are put right by -y, the rest need more than a counter changed
+#define FSCK_FIXABLE(kind) ((kind) == FSCK_I_BLOCKS || (kind) == FSCK_LINKS || \
+	(kind) == FSCK_BLOCK_BITMAP || (kind) == FSCK_INODE_BITMAP || (kind) == FSCK_COUNTS)
+
+/*
+ * A check shared by the workers. Each one takes a chunk of the inode table at
+ * a time and, for the inodes in use, sets their bits and the bits of their
+ * blocks in the expected bitmaps and counts the entries in directories. Bits
+ * are set with atomic ors, so a block already set shows up as a duplicate.
+ * Each group's part of an expected bitmap is whole words, to line up with
+ * the bitmap on disk.
+ */
+struct fsck_job {
+	unsigned char *disk;
+	int repair;
+	unsigned int groups;
+	unsigned int block_words;       // Words per group in blocks
+	unsigned int inode_words;       // And in inodes
+	uint64_t *blocks;               // Blocks that should be in use
+	uint64_t *inodes;               // Inodes that should be in use
+	unsigned int *refs;             // Entries for each inode
+	unsigned int *dirs;             // Directories in each group
+	unsigned int next;              // First inode of the next chunk
+	unsigned int problems[FSCK_KINDS];
+};
+
+const char *fsck_kinds[FSCK_KINDS] = {
+	"bad block numbers", "duplicate blocks", "bad entries", "wrong i_blocks", "wrong link counts",
+	"unattached inodes", "free inodes in directories", "block bitmap differences",
+	"inode bitmap differences", "wrong counts"
+};
+
+/*
+ * Notes a problem, printing the first few of each kind
+ */
+void fsck_report(struct fsck_job *job, int kind, const char *format, ...) {
+	va_list args;
+	if (__atomic_fetch_add(&job->problems[kind], 1, __ATOMIC_RELAXED) >= FSCK_MAX_REPORTS) return;
+
+	va_start(args, format);
+	flockfile(stdout);
+	vprintf(format, args);
+	putchar('\n');
+	funlockfile(stdout);
+	va_end(args);
+}
+
+int block_valid(unsigned char *disk, unsigned int block) {
+	struct ext2_super_block *sb = EXT2_SUPER_BLOCK(disk);
+	return block >= sb->s_first_data_block && block < sb->s_blocks_count;
+}
+
+/*
+ * Sets a block in the expected bitmap. Returns 0 if it isn't on the image
+ */
+int fsck_block(struct fsck_job *job, unsigned int number, unsigned int block) {
+	struct ext2_super_block *sb = EXT2_SUPER_BLOCK(job->disk);
+	if (!block_valid(job->disk, block)) {
+		fsck_report(job, FSCK_BAD_BLOCK, "Inode %u has block %u, past the end of the image", number, block);
+		return 0;
+	}
+
+	unsigned int index = block - sb->s_first_data_block, group = index / sb->s_blocks_per_group;
+	unsigned int bit = index % sb->s_blocks_per_group;
+	uint64_t mask = 1ULL << (bit % 64);
+	uint64_t *word = job->blocks + (size_t)group * job->block_words + bit / 64;
+
+	if (__atomic_fetch_or(word, mask, __ATOMIC_RELAXED) & mask) {
+		if (number) fsck_report(job, FSCK_DUP_BLOCK, "Block %u of inode %u is in use elsewhere too", block, number);
+		else fsck_report(job, FSCK_DUP_BLOCK, "Block %u of group metadata is in use elsewhere too", block);
+	}
+	return 1;
+}
+
+/*
+ * Counts the entries in a directory block
+ */
+void fsck_entries(struct fsck_job *job, unsigned int number, unsigned char *block) {
+	struct ext2_super_block *sb = EXT2_SUPER_BLOCK(job->disk);
+	struct ext2_dir_entry_2 *entry;
+	struct ext2_dir_iter it;
+
+	dir_iter_block(&it, block);
+	while ((entry = dir_iter_next(&it))) {
+		if (!entry->inode) continue;
+		if (entry->inode > sb->s_inodes_count) {
+			fsck_report(job, FSCK_BAD_ENTRY, "Directory %u has '%.*s' for inode %u, past the last inode",
+				number, entry->name_len, entry->name, entry->inode);
+			continue;
+		}
+		__atomic_fetch_add(&job->refs[entry->inode - 1], 1, __ATOMIC_RELAXED);
+	}
+}
+
+/*
+ * Goes through a block of an inode's map, depth levels of indirect blocks
+ * above the data. Returns how many blocks it's made of
+ */
+unsigned int fsck_tree(struct fsck_job *job, unsigned int number, unsigned int block, int depth, int is_dir) {
+	unsigned int count = 1, i;
+
+	if (!fsck_block(job, number, block)) return 0;
+	if (!depth) {
+		if (is_dir) fsck_entries(job, number, EXT2_BLOCK(job->disk, block));
+		return count;
+	}
+
+	unsigned int *table = (unsigned int *)EXT2_BLOCK(job->disk, block);
+	for (i = 0; i < EXT2_INDIRECT_BLOCKS; i++) {
+		if (table[i]) count += fsck_tree(job, number, table[i], depth - 1, is_dir);
+	}
+	return count;
+}
+
+/*
+ * Checks one inode, returning 1 if it's in use
+ */
+int fsck_inode(struct fsck_job *job, unsigned int number) {
+	unsigned char *disk = job->disk;
+	struct ext2_inode *inode = get_inode(disk, number);
+	int reserved = number < EXT2_FIRST_INO(disk) && number != EXT2_ROOT_INO;
+	int is_dir = (inode->i_mode & 0xF000) == EXT2_S_IFDIR;
+	unsigned int count = 0, i, index = number - 1;
+
+	// Reserved inodes are always in use, the rest while they have links
+	if (!reserved && (!inode->i_links_count || !inode->i_mode)) return 0;
+
+	unsigned int group = index / EXT2_SUPER_BLOCK(disk)->s_inodes_per_group;
+	unsigned int bit = index % EXT2_SUPER_BLOCK(disk)->s_inodes_per_group;
+	__atomic_fetch_or(job->inodes + (size_t)group * job->inode_words + bit / 64, 1ULL << (bit % 64), __ATOMIC_RELAXED);
+	if (is_dir && !reserved) __atomic_fetch_add(&job->dirs[group], 1, __ATOMIC_RELAXED);
+
+	// The resize inode's map is made of the reserved descriptor blocks, which go with the groups
+	if (number == EXT2_RESIZE_INO) {
+		if (inode->i_block[EXT2_DIRECT_BLOCKS + 1]) fsck_block(job, number, inode->i_block[EXT2_DIRECT_BLOCKS + 1]);
+		return 1;
+	}
+
+	// A fast symlink's i_block is its target
+	if (EXT2_IS_FAST_LINK(inode)) return 1;
+
+	for (i = 0; i < EXT2_DIRECT_BLOCKS + 3; i++) {
+		if (!inode->i_block[i]) continue;
+		count += fsck_tree(job, number, inode->i_block[i], i < EXT2_DIRECT_BLOCKS ? 0 : i - EXT2_DIRECT_BLOCKS + 1, is_dir && !reserved);
+	}
+
+	unsigned int sectors = count * (EXT2_BLOCK_SIZE / 512);
+	if (inode->i_blocks != sectors) {
+		fsck_report(job, FSCK_I_BLOCKS, "Inode %u has i_blocks %u, should be %u", number, inode->i_blocks, sectors);
+		if (job->repair) {
+			inode->i_blocks = sectors;
+			mark_inode(disk, inode);
+		}
+	}
+	return 1;
+}
+
+void *fsck_worker(void *arg) {
+	struct fsck_job *job = arg;
+	unsigned int total = EXT2_SUPER_BLOCK(job->disk)->s_inodes_count, first, number;
+
+	while ((first = __atomic_fetch_add(&job->next, FSCK_CHUNK, __ATOMIC_RELAXED)) <= total) {
+		for (number = MAX(first, 1); number < first + FSCK_CHUNK && number <= total; number++) {
+			fsck_inode(job, number);
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Sets the blocks each group's own metadata takes up: the superblock and
+ * descriptor copies if it has them, its bitmaps and its inode table. All from
+ * the layout, so a bitmap that lost any of them shows up
+ */
+void fsck_metadata(struct fsck_job *job) {
+	unsigned char *disk = job->disk;
+	struct ext2_super_block *sb = EXT2_SUPER_BLOCK(disk);
+	unsigned int table_blocks = ((size_t)sb->s_inodes_per_group * EXT2_INODE_SIZE(disk) + EXT2_BLOCK_SIZE - 1) / EXT2_BLOCK_SIZE;
+	unsigned int group, block, i;
+
+	for (group = 0; group < job->groups; group++) {
+		struct ext2_group_desc *desc = get_group_desc(disk, group);
+		unsigned int start = sb->s_first_data_block + group * sb->s_blocks_per_group;
+		unsigned int end = start + MIN(group_super_blocks(disk, group), group_blocks(disk, group));
+
+		for (block = start; block < end; block++) {
+			fsck_block(job, 0, block);
+		}
+		fsck_block(job, 0, desc->bg_block_bitmap);
+		fsck_block(job, 0, desc->bg_inode_bitmap);
+		for (i = 0; i < table_blocks; i++) {
+			fsck_block(job, 0, desc->bg_inode_table + i);
+		}
+	}
+}
+
+/*
+ * XORs a group's part of an expected bitmap with the one on disk a word at a
+ * time, reporting the bits that differ and copying the expected ones over if
+ * repairing. first is the number of the group's first block or inode. Returns
+ * how many of its bits are free
+ */
+unsigned int fsck_bitmap(struct fsck_job *job, int kind, uint64_t *expected, unsigned char *map, unsigned int bits, unsigned int first) {
+	const char *what = kind == FSCK_BLOCK_BITMAP ? "Block" : "Inode";
+	unsigned int used = 0, w, words = (bits + 63) / 64;
+	uint64_t disk, mask, diff;
+
+	for (w = 0; w < words; w++) {
+		mask = w == words - 1 && bits % 64 ? (1ULL << (bits % 64)) - 1 : ~0ULL;
+		memcpy(&disk, map + w * 8, sizeof(disk));
+		used += __builtin_popcountll(expected[w] & mask);
+
+		diff = (disk ^ expected[w]) & mask;
+		if (!diff) continue;
+
+		for (; diff; diff &= diff - 1) {
+			unsigned int bit = __builtin_ctzll(diff);
+			fsck_report(job, kind, "%s %u is marked %s, should be %s", what, first + w * 64 + bit,
+				(expected[w] >> bit) & 1 ? "free" : "in use", (expected[w] >> bit) & 1 ? "in use" : "free");
+		}
+		if (job->repair) {
+			disk = (disk & ~mask) | (expected[w] & mask);
+			memcpy(map + w * 8, &disk, sizeof(disk));
+			mark_dirty(job->disk, map + w * 8, sizeof(disk));
+		}
+	}
+	return bits - used;
+}
+
+/*
+ * Compares a counter against what it should be, fixing it if repairing
+ */
+void fsck_count(struct fsck_job *job, const char *what, unsigned int group, void *counter, int wide, unsigned int expected) {
+	unsigned int value = wide ? *(unsigned int *)counter : *(unsigned short *)counter;
+	if (value == expected) return;
+
+	if (group == ~0U) fsck_report(job, FSCK_COUNTS, "Superblock %s is %u, should be %u", what, value, expected);
+	else fsck_report(job, FSCK_COUNTS, "Group %u %s is %u, should be %u", group, what, value, expected);
+	if (job->repair) {
+		if (wide) *(unsigned int *)counter = expected;
+		else *(unsigned short *)counter = expected;
+		mark_dirty(job->disk, counter, wide ? sizeof(unsigned int) : sizeof(unsigned short));
+	}
+}
+
+/*
+ * Checks the whole image, returning an e2fsck exit status
+ */
+int ext2_fsck(unsigned char *disk, char *image, int repair) {
+	struct ext2_super_block *sb = EXT2_SUPER_BLOCK(disk);
+	pthread_t workers[FSCK_MAX_WORKERS];
+	struct fsck_job job;
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int count = MAX(1, MIN(cpus, FSCK_MAX_WORKERS)), started, i, status = FSCK_OK;
+	unsigned int group, number, free_blocks = 0, free_inodes = 0, used_inodes = 0;
+
+	memset(&job, 0, sizeof(job));
+	job.disk = disk;
+	job.repair = repair;
+	job.groups = EXT2_GROUP_COUNT(disk);
+	job.block_words = (sb->s_blocks_per_group + 63) / 64;
+	job.inode_words = (sb->s_inodes_per_group + 63) / 64;
+	job.blocks = calloc((size_t)job.groups * job.block_words, sizeof(uint64_t));
+	job.inodes = calloc((size_t)job.groups * job.inode_words, sizeof(uint64_t));
+	job.refs = calloc(sb->s_inodes_count, sizeof(unsigned int));
+	job.dirs = calloc(job.groups, sizeof(unsigned int));
+	assert(job.blocks && job.inodes && job.refs && job.dirs);
+
+	// One pass over the inode table, building what the bitmaps should be
+	fsck_metadata(&job);
+	for (started = 0; started < count; started++) {
+		if (pthread_create(&workers[started], NULL, fsck_worker, &job)) break;
+	}
+	if (!started) fsck_worker(&job);
+	for (i = 0; i < started; i++) {
+		pthread_join(workers[i], NULL);
+	}
+
+	// Links against the entries pointing at each inode
+	for (number = 1; number <= sb->s_inodes_count; number++) {
+		unsigned int index = number - 1, bit = index % sb->s_inodes_per_group;
+		int used = (job.inodes[(size_t)(index / sb->s_inodes_per_group) * job.inode_words + bit / 64] >> (bit % 64)) & 1;
+		struct ext2_inode *inode = get_inode(disk, number);
+		unsigned int refs = job.refs[index];
+
+		if (number < EXT2_FIRST_INO(disk) && number != EXT2_ROOT_INO) continue;
+		if (!used && refs) {
+			fsck_report(&job, FSCK_FREE_LINKED, "Inode %u is free, but is in %u directory entries", number, refs);
+		} else if (used && !refs) {
+			fsck_report(&job, FSCK_UNATTACHED, "Inode %u is in use, but in no directory", number);
+		} else if (used && refs != inode->i_links_count) {
+			fsck_report(&job, FSCK_LINKS, "Inode %u has %u links, should be %u", number, inode->i_links_count, refs);
+			if (repair) {
+				inode->i_links_count = refs;
+				mark_inode(disk, inode);
+			}
+		}
+	}
+
+	// Then the bitmaps and counts on disk against the ones built
+	for (group = 0; group < job.groups; group++) {
+		struct ext2_group_desc *desc = get_group_desc(disk, group);
+		unsigned int blocks = fsck_bitmap(&job, FSCK_BLOCK_BITMAP, job.blocks + (size_t)group * job.block_words,
+			EXT2_BLOCK(disk, desc->bg_block_bitmap), group_blocks(disk, group), sb->s_first_data_block + group * sb->s_blocks_per_group);
+		unsigned int inodes = fsck_bitmap(&job, FSCK_INODE_BITMAP, job.inodes + (size_t)group * job.inode_words,
+			EXT2_BLOCK(disk, desc->bg_inode_bitmap), sb->s_inodes_per_group, 1 + group * sb->s_inodes_per_group);
+
+		fsck_count(&job, "free blocks", group, &desc->bg_free_blocks_count, 0, blocks);
+		fsck_count(&job, "free inodes", group, &desc->bg_free_inodes_count, 0, inodes);
+		fsck_count(&job, "used directories", group, &desc->bg_used_dirs_count, 0, job.dirs[group]);
+		free_blocks += blocks;
+		free_inodes += inodes;
+	}
+	fsck_count(&job, "free blocks", ~0U, &sb->s_free_blocks_count, 1, free_blocks);
+	fsck_count(&job, "free inodes", ~0U, &sb->s_free_inodes_count, 1, free_inodes);
+	used_inodes = sb->s_inodes_count - free_inodes;
+
+	for (i = 0; i < FSCK_KINDS; i++) {
+		if (!job.problems[i]) continue;
+		printf("%u %s%s\n", job.problems[i], fsck_kinds[i], repair && FSCK_FIXABLE(i) ? ", fixed" : "");
+		if (!repair || !FSCK_FIXABLE(i)) status = FSCK_UNFIXED;
+		else if (status == FSCK_OK) status = FSCK_FIXED;
+	}
+	printf("%s: %u/%u inodes, %u/%u blocks\n", image, used_inodes, sb->s_inodes_count,
+		sb->s_blocks_count - free_blocks, sb->s_blocks_count);
+
+	free(job.blocks);
+	free(job.inodes);
+	free(job.refs);
+	free(job.dirs);
+	return status;
+}
+
+int main(int argc, char *argv[]) {
+	argc = image_options(argc, argv);
+	int repair = argc == 3 && !strcmp(argv[2], "-y");
+
+	if (argc != 2 && !repair) {
+		fprintf(stderr, usage, argv[0]);
+		return FSCK_USAGE;
+	}
+
+	// Only a repair changes anything, so a check can run alongside readers
+	unsigned char *disk = read_image(argv[1], repair ? EXT2_ACCESS_WRITE : EXT2_ACCESS_READ);
+	return ext2_fsck(disk, argv[1], repair);
+}
@@ -0,0 +1,515 @@
+#ifndef CSC369A3_EXT2_HTREE_H
+#define CSC369A3_EXT2_HTREE_H
+
+/*
+ * Hashed directory index (htree), laid out the same as ext3/ext4 does it.
+ *
+ * Block 0 of an indexed directory holds . and .., with .. covering the rest of
+ * the block. The index lives in that space, mapping name hashes to the leaf
+ * block that holds them, sometimes through one level of node blocks. Nodes
+ * start with an unused entry covering the whole block, so anything that
+ * doesn't know about the index still sees an ordinary directory.
+ *
+ * https://www.nongnu.org/ext2-doc/ext2.html#indexed-directory
+ *
+ * Included at the end of ext2_welp.h, which declares what it uses from here.
+ */
+
+#define EXT2_HASH_LEGACY 0
+#define EXT2_FLAGS_UNSIGNED_HASH 0x0002
+#define EXT2_HTREE_EOF 0x7fffffff
+
+// s_flags isn't in our superblock struct, it's in the padding
+#define EXT2_SB_FLAGS(sb) ((sb)->s_reserved[22])
+
+#define DX_MAX_LEVELS 2 // Root, plus one level of nodes
+#define DX_ROOT_LIMIT ((EXT2_BLOCK_SIZE - 32) / sizeof(struct dx_entry))
+#define DX_NODE_LIMIT ((EXT2_BLOCK_SIZE - 8) / sizeof(struct dx_entry))
+#define DX_LEAF_FILL (EXT2_BLOCK_SIZE * 3 / 4) // Leave room to grow when building
+#define DX_NODE_FILL (DX_NODE_LIMIT * 3 / 4)
+#define DX_MAX_BLOCKS (1 + DX_ROOT_LIMIT * (1 + DX_NODE_LIMIT)) // Root, nodes and their leaves
+
+struct dx_root_info {
+    unsigned int   reserved_zero;
+    unsigned char  hash_version;
+    unsigned char  info_length;      /* 8 */
+    unsigned char  indirect_levels;  /* Levels of nodes under the root */
+    unsigned char  unused_flags;
+};
+
+struct dx_entry {
+    unsigned int   hash;
+    unsigned int   block;  /* Logical block in the directory */
+};
+
+/*
+ * Overlays the hash of the first entry of an index block, which covers
+ * everything below the second entry anyway
+ */
+struct dx_countlimit {
+    unsigned short limit;
+    unsigned short count;
+};
+
+/*
+ * Where a lookup went through an index block
+ */
+struct dx_frame {
+    struct dx_entry *entries;
+    struct dx_entry *at;
+};
+
+/*
+ * An entry and its hash, for sorting
+ */
+struct dx_map {
+    unsigned int hash;
+    struct ext2_dir_entry_2 *entry;
+};
+
+#define DX_COUNTLIMIT(entries) ((struct dx_countlimit *)(entries))
+#define DX_ROOT_INFO(block) ((struct dx_root_info *)((block) + 24))
+#define DX_ROOT_ENTRIES(block) ((struct dx_entry *)((block) + 32))
+#define DX_NODE_ENTRIES(block) ((struct dx_entry *)((block) + 8))
+
+/*
+ * Hash of a name, the legacy one from ext3 (dx_hack_hash)
+ */
+unsigned int dx_hash(unsigned char *disk, const char *name, int len) {
+    int is_unsigned = EXT2_SB_FLAGS(EXT2_SUPER_BLOCK(disk)) & EXT2_FLAGS_UNSIGNED_HASH;
+    unsigned int hash, hash0 = 0x12a3fe2d, hash1 = 0x37abe8f9;
+    int c;
+
+    while (len--) {
+        c = is_unsigned ? (int)(unsigned char)*name : (int)(signed char)*name;
+        name++;
+
+        hash = hash1 + (hash0 ^ (c * 7152373));
+        if (hash & 0x80000000) hash -= 0x7fffffff;
+        hash1 = hash0;
+        hash0 = hash;
+    }
+
+    // Low bit is for collisions in the index, and the biggest one means end of directory
+    hash = (hash0 << 1) & ~1;
+    if (hash == (EXT2_HTREE_EOF << 1)) hash = (EXT2_HTREE_EOF - 1) << 1;
+    return hash;
+}
+
+int dx_compare(const void *a, const void *b) {
+    unsigned int x = ((struct dx_map *)a)->hash, y = ((struct dx_map *)b)->hash;
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Gets logical block n of the directory
+ */
+unsigned char *dx_block(unsigned char *disk, struct ext2_inode *inode, unsigned int n) {
+    unsigned int block = n < EXT2_DIR_BLOCKS(inode) ? get_block_number(disk, inode, n) : 0;
+    return block ? EXT2_BLOCK(disk, block) : NULL;
+}
+
+int dx_is_indexed(unsigned char *disk, struct ext2_inode *inode) {
+    return (inode->i_flags & EXT2_INDEX_FL) &&
+        (EXT2_SUPER_BLOCK(disk)->s_feature_compat & EXT2_FEATURE_COMPAT_DIR_INDEX);
+}
+
+/*
+ * Walks the index down to the leaf for hash, filling in a frame for each index
+ * block on the way. Returns the level of the last one, or -1 if it's broken
+ */
+int dx_probe(unsigned char *disk, struct ext2_inode *inode, unsigned int hash, struct dx_frame *frames) {
+    unsigned char *root = dx_block(disk, inode, 0);
+    if (!root) return -1;
+
+    struct dx_root_info *info = DX_ROOT_INFO(root);
+    if (info->reserved_zero || info->info_length != 8 || info->hash_version != EXT2_HASH_LEGACY ||
+        info->indirect_levels >= DX_MAX_LEVELS) {
+        return -1;
+    }
+
+    struct dx_entry *entries = DX_ROOT_ENTRIES(root);
+    unsigned int limit = DX_ROOT_LIMIT;
+    int level;
+
+    for (level = 0; ; level++) {
+        struct dx_countlimit *countlimit = DX_COUNTLIMIT(entries);
+        if (countlimit->limit != limit || !countlimit->count || countlimit->count > limit) return -1;
+
+        // Last entry with a hash no bigger than ours
+        struct dx_entry *p = entries + 1, *q = entries + countlimit->count - 1, *m;
+        while (p <= q) {
+            m = p + (q - p) / 2;
+            if (m->hash > hash) {
+                q = m - 1;
+            } else {
+                p = m + 1;
+            }
+        }
+        frames[level].entries = entries;
+        frames[level].at = p - 1;
+
+        if (level == info->indirect_levels) return level;
+
+        unsigned char *node = dx_block(disk, inode, frames[level].at->block);
+        if (!node) return -1;
+        entries = DX_NODE_ENTRIES(node);
+        limit = DX_NODE_LIMIT;
+    }
+}
+
+/*
+ * Stop using the index. Every block is still a valid directory block, so the
+ * directory just goes back to being searched in order
+ */
+void dx_unindex(struct ext2_inode *inode) {
+    inode->i_flags &= ~EXT2_INDEX_FL;
+}
+
+/*
+ * Looks for a name in the leaf it hashes to. Returns 1 if the directory isn't
+ * indexed, so it has to be looked through the slow way
+ */
+int dx_find(unsigned char *disk, struct ext2_inode *inode, struct ext2_name name, struct ext2_dir_entry_2 **found) {
+    struct dx_frame frames[DX_MAX_LEVELS];
+    struct ext2_dir_iter it;
+    int level;
+
+    // . and .. are only in the root
+    *found = NULL;
+    if (!dx_is_indexed(disk, inode) || name_is_dots(name)) return 1;
+
+    level = dx_probe(disk, inode, dx_hash(disk, name.ptr, name.len), frames);
+    unsigned char *leaf = level < 0 ? NULL : dx_block(disk, inode, frames[level].at->block);
+    if (!leaf) return 1;
+
+    dir_iter_block(&it, leaf);
+    while ((*found = dir_iter_next(&it)) && !((*found)->inode && name_eq(entry_name(*found), name)));
+    return 0;
+}
+
+/*
+ * Puts an entry in after at in an index block, which must have room
+ */
+void dx_insert(struct dx_frame *frame, unsigned int hash, unsigned int block) {
+    struct dx_countlimit *countlimit = DX_COUNTLIMIT(frame->entries);
+    struct dx_entry *at = frame->at + 1, *end = frame->entries + countlimit->count;
+
+    memmove(at + 1, at, (end - at) * sizeof(struct dx_entry));
+    at->hash = hash;
+    at->block = block;
+    countlimit->count++;
+}
+
+/*
+ * Packs entries into a leaf, the last one taking the rest of the block
+ */
+void dx_fill_leaf(unsigned char *leaf, struct dx_map *map, unsigned int count) {
+    struct ext2_dir_entry_2 *entry = (struct ext2_dir_entry_2 *)leaf;
+    unsigned int i, offset = 0, size;
+
+    memset(leaf, '\0', EXT2_BLOCK_SIZE);
+    for (i = 0; i < count; i++) {
+        size = EXT2_ENTRY_SIZE(map[i].entry);
+        entry = (struct ext2_dir_entry_2 *)(leaf + offset);
+        memcpy(entry, map[i].entry, size);
+        entry->rec_len = size;
+        offset += size;
+    }
+
+    entry->rec_len += EXT2_BLOCK_SIZE - offset;
+}
+
+/*
+ * Moves the entries of the root into a new node under it
+ */
+void dx_grow(unsigned char *disk, struct ext2_inode *inode) {
+    unsigned int logical;
+    unsigned char *node = add_dir_block(disk, inode, &logical);
+    unsigned char *root = dx_block(disk, inode, 0);
+    struct dx_entry *entries = DX_ROOT_ENTRIES(root);
+    struct dx_countlimit *countlimit = DX_COUNTLIMIT(entries);
+
+    // New block is already a single unused entry, which is what a node needs
+    memcpy(DX_NODE_ENTRIES(node), entries, countlimit->count * sizeof(struct dx_entry));
+    DX_COUNTLIMIT(DX_NODE_ENTRIES(node))->limit = DX_NODE_LIMIT;
+
+    countlimit->count = 1;
+    entries[0].block = logical;
+    DX_ROOT_INFO(root)->indirect_levels = 1;
+    mark_dirty(disk, root, EXT2_BLOCK_SIZE);
+}
+
+/*
+ * Moves the top half of a full node into a new one, and adds that to the root
+ */
+void dx_split_node(unsigned char *disk, struct ext2_inode *inode, struct dx_frame *frames) {
+    struct dx_entry *entries = frames[1].entries;
+    struct dx_countlimit *countlimit = DX_COUNTLIMIT(entries);
+    unsigned int half = countlimit->count / 2, moved = countlimit->count - half, logical;
+    unsigned int hash = entries[half].hash;
+
+    unsigned char *node = add_dir_block(disk, inode, &logical);
+    memcpy(DX_NODE_ENTRIES(node), entries + half, moved * sizeof(struct dx_entry));
+    DX_COUNTLIMIT(DX_NODE_ENTRIES(node))->limit = DX_NODE_LIMIT;
+    DX_COUNTLIMIT(DX_NODE_ENTRIES(node))->count = moved;
+    countlimit->count = half;
+    mark_dirty(disk, entries, sizeof(struct dx_entry));
+
+    dx_insert(&frames[0], hash, logical);
+    mark_dirty(disk, frames[0].entries, sizeof(struct dx_entry));
+}
+
+/*
+ * Moves the top half (by hash) of a full leaf into a new one, and adds it to
+ * the index block above. Returns -1 if it can't be split
+ */
+int dx_split_leaf(unsigned char *disk, struct ext2_inode *inode, struct dx_frame *frame, unsigned char *leaf) {
+    struct dx_map map[EXT2_MAX_BLOCK_SIZE / 12];
+    unsigned char copy[EXT2_MAX_BLOCK_SIZE];
+    struct ext2_dir_entry_2 *entry;
+    struct ext2_dir_iter it;
+    int count = 0, total = 0, size = 0, split, i;
+    unsigned int logical;
+
+    // Work off a copy, since the leaf gets rewritten
+    memcpy(copy, leaf, EXT2_BLOCK_SIZE);
+    dir_iter_block(&it, copy);
+    while ((entry = dir_iter_next(&it))) {
+        if (!entry->inode) continue;
+        map[count].hash = dx_hash(disk, entry->name, entry->name_len);
+        map[count].entry = entry;
+        total += EXT2_ENTRY_SIZE(entry);
+        count++;
+    }
+    qsort(map, count, sizeof(struct dx_map), dx_compare);
+
+    // Split around half the bytes, but never between two names with the same hash
+    for (split = 0; split < count && size + EXT2_ENTRY_SIZE(map[split].entry) <= total / 2; split++) {
+        size += EXT2_ENTRY_SIZE(map[split].entry);
+    }
+    for (i = 0; i < count; i++) {
+        if (split + i < count && split + i > 0 && map[split + i].hash != map[split + i - 1].hash) {
+            split += i;
+            break;
+        }
+        if (split - i < count && split - i > 0 && map[split - i].hash != map[split - i - 1].hash) {
+            split -= i;
+            break;
+        }
+    }
+    if (i == count) return -1;
+
+    unsigned char *new_leaf = add_dir_block(disk, inode, &logical);
+    dx_fill_leaf(leaf, map, split);
+    dx_fill_leaf(new_leaf, map + split, count - split);
+    dx_insert(frame, map[split].hash, logical);
+    mark_dirty(disk, frame->entries, sizeof(struct dx_entry));
+    mark_dirty(disk, leaf, EXT2_BLOCK_SIZE);
+
+    // Entries moved around
+    dcache_flush();
+    return 0;
+}
+
+/*
+ * Finds room for an entry in the leaf its name hashes to, splitting things as
+ * needed. Returns NULL if the index can't take it, in which case the directory
+ * stops being indexed
+ */
+struct ext2_dir_entry_2 *dx_add(unsigned char *disk, struct ext2_inode *inode, char *name, int required) {
+    struct dx_frame frames[DX_MAX_LEVELS];
+    struct ext2_dir_entry_2 *entry, *room;
+    struct ext2_dir_iter it;
+    unsigned int hash = dx_hash(disk, name, strlen(name));
+    int tries, level;
+
+    for (tries = 0; tries < 8; tries++) {
+        level = dx_probe(disk, inode, hash, frames);
+        unsigned char *leaf = level < 0 ? NULL : dx_block(disk, inode, frames[level].at->block);
+        if (!leaf) break;
+
+        // Any space in the leaf?
+        dir_iter_block(&it, leaf);
+        while ((entry = dir_iter_next(&it))) {
+            if ((room = make_room(entry, required))) return room;
+        }
+
+        // Need another leaf, so make sure the index has room for it first
+        unsigned int limit = level ? DX_NODE_LIMIT : DX_ROOT_LIMIT;
+        if (DX_COUNTLIMIT(frames[level].entries)->count >= limit) {
+            if (EXT2_DIR_BLOCKS(inode) + 2 > DX_MAX_BLOCKS) break;
+
+            if (level == 0 && level + 1 < DX_MAX_LEVELS) {
+                dx_grow(disk, inode);
+            } else if (level > 0 && DX_COUNTLIMIT(frames[0].entries)->count < DX_ROOT_LIMIT) {
+                dx_split_node(disk, inode, frames);
+            } else {
+                break;
+            }
+            continue;
+        }
+
+        if (EXT2_DIR_BLOCKS(inode) + 1 > DX_MAX_BLOCKS || dx_split_leaf(disk, inode, &frames[level], leaf)) break;
+    }
+
+    dx_unindex(inode);
+    mark_inode(disk, inode);
+    return NULL;
+}
+
+/*
+ * Builds the index for a directory, repacking its entries in hash order.
+ * Returns 0 if it worked, else an error and the directory is left alone
+ */
+int dx_build(unsigned char *disk, struct ext2_inode *inode) {
+    unsigned int blocks = EXT2_DIR_BLOCKS(inode), self = 0, parent = 0;
+    unsigned int count = 0, leaves = 0, nodes, needed, size = 0, i, j;
+    struct ext2_dir_entry_2 *entry;
+    struct ext2_dir_iter it;
+    unsigned char *block;
+    int too_many = 0;
+
+    if (!blocks) return ENOTDIR;
+
+    // Copy the whole directory out, since it gets rewritten in place
+    unsigned char *copy = malloc(blocks * EXT2_BLOCK_SIZE);
+    struct dx_map *map = malloc(blocks * (EXT2_BLOCK_SIZE / 12) * sizeof(struct dx_map));
+    unsigned int *starts = malloc((blocks * (EXT2_BLOCK_SIZE / 12) + 2) * sizeof(unsigned int));
+    assert(copy && map && starts);
+
+    for (i = 0; i < blocks; i++) {
+        block = copy + i * EXT2_BLOCK_SIZE;
+        memcpy(block, dx_block(disk, inode, i), EXT2_BLOCK_SIZE);
+
+        dir_iter_block(&it, block);
+        while ((entry = dir_iter_next(&it))) {
+            if (!entry->inode) continue;
+
+            if (name_eq(entry_name(entry), str_name("."))) {
+                self = entry->inode;
+            } else if (name_eq(entry_name(entry), str_name(".."))) {
+                parent = entry->inode;
+            } else {
+                map[count].hash = dx_hash(disk, entry->name, entry->name_len);
+                map[count].entry = entry;
+                count++;
+            }
+        }
+    }
+    qsort(map, count, sizeof(struct dx_map), dx_compare);
+
+    // Group into leaves, part full so there's room to grow. Same hashes stay together
+    for (i = 0; i < count; i++) {
+        unsigned int entry_size = EXT2_ENTRY_SIZE(map[i].entry);
+        int same = i && map[i].hash == map[i - 1].hash;
+
+        if (same && size + entry_size > EXT2_BLOCK_SIZE) {
+            too_many = 1;
+            break;
+        }
+        if (!leaves || (!same && size + entry_size > DX_LEAF_FILL)) {
+            starts[leaves++] = i;
+            size = 0;
+        }
+        size += entry_size;
+    }
+    if (!leaves) starts[leaves++] = 0;
+    starts[leaves] = count;
+
+    nodes = leaves > DX_ROOT_LIMIT ? (leaves + DX_NODE_FILL - 1) / DX_NODE_FILL : 0;
+    needed = 1 + nodes + leaves;
+    if (too_many || nodes > DX_ROOT_LIMIT || needed > DX_MAX_BLOCKS) {
+        free(copy);
+        free(map);
+        free(starts);
+        return EFBIG;
+    }
+
+    // Exactly as many blocks as needed: root, nodes, then leaves
+    truncate_dir_blocks(disk, inode, MIN(blocks, needed));
+    while (EXT2_DIR_BLOCKS(inode) < needed) {
+        add_dir_block(disk, inode, NULL);
+    }
+
+    // Root, with .. covering the index
+    unsigned char *root = dx_block(disk, inode, 0);
+    memset(root, '\0', EXT2_BLOCK_SIZE);
+    entry = (struct ext2_dir_entry_2 *)root;
+    entry->inode = self;
+    entry->rec_len = 12;
+    entry->name_len = 1;
+    entry->file_type = EXT2_FT_DIR;
+    memcpy(entry->name, ".", 1);
+
+    entry = EXT2_NEXT_FILE(entry);
+    entry->inode = parent;
+    entry->rec_len = EXT2_BLOCK_SIZE - 12;
+    entry->name_len = 2;
+    entry->file_type = EXT2_FT_DIR;
+    memcpy(entry->name, "..", 2);
+
+    struct dx_root_info *info = DX_ROOT_INFO(root);
+    info->hash_version = EXT2_HASH_LEGACY;
+    info->info_length = 8;
+    info->indirect_levels = nodes ? 1 : 0;
+
+    for (i = 0; i < leaves; i++) {
+        dx_fill_leaf(dx_block(disk, inode, 1 + nodes + i), map + starts[i], starts[i + 1] - starts[i]);
+    }
+
+    // Index entries point at leaves (through nodes if needed), keyed by their first hash
+    struct dx_entry *entries = DX_ROOT_ENTRIES(root);
+    if (!nodes) {
+        for (i = 1; i < leaves; i++) {
+            entries[i].hash = map[starts[i]].hash;
+            entries[i].block = 1 + i;
+        }
+        entries[0].block = 1;
+        DX_COUNTLIMIT(entries)->limit = DX_ROOT_LIMIT;
+        DX_COUNTLIMIT(entries)->count = leaves;
+    } else {
+        unsigned int per = (leaves + nodes - 1) / nodes, first, last;
+
+        for (i = 0; i < nodes; i++) {
+            first = i * per;
+            last = MIN(first + per, leaves);
+
+            block = dx_block(disk, inode, 1 + i);
+            memset(block, '\0', EXT2_BLOCK_SIZE);
+            ((struct ext2_dir_entry_2 *)block)->rec_len = EXT2_BLOCK_SIZE;
+
+            struct dx_entry *node_entries = DX_NODE_ENTRIES(block);
+            for (j = first + 1; j < last; j++) {
+                node_entries[j - first].hash = map[starts[j]].hash;
+                node_entries[j - first].block = 1 + nodes + j;
+            }
+            node_entries[0].block = 1 + nodes + first;
+            DX_COUNTLIMIT(node_entries)->limit = DX_NODE_LIMIT;
+            DX_COUNTLIMIT(node_entries)->count = last - first;
+
+            if (i) entries[i].hash = map[starts[first]].hash;
+            entries[i].block = 1 + i;
+        }
+        DX_COUNTLIMIT(entries)->limit = DX_ROOT_LIMIT;
+        DX_COUNTLIMIT(entries)->count = nodes;
+    }
+
+    inode->i_flags |= EXT2_INDEX_FL;
+    EXT2_SUPER_BLOCK(disk)->s_feature_compat |= EXT2_FEATURE_COMPAT_DIR_INDEX;
+    dcache_flush();
+
+    // Every block got rewritten
+    for (i = 0; i < needed; i++) {
+        mark_dirty(disk, dx_block(disk, inode, i), EXT2_BLOCK_SIZE);
+    }
+    mark_dirty(disk, EXT2_SUPER_BLOCK(disk), sizeof(struct ext2_super_block));
+    mark_inode(disk, inode);
+
+    free(copy);
+    free(map);
+    free(starts);
+    return 0;
+}
+
+#endif
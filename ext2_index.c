@@ -0,0 +1,41 @@
+#include <stdio.h>
+#include "ext2_welp.h"
+
+#ifndef EXT2_NO_MAIN
+char *usage = "USAGE: %s [--journal] [--sync=none|range|full] disk path\n";
+#endif
+
+/*
+ * Builds (or rebuilds) the hashed index of a directory
+ */
+int ext2_index(unsigned char *disk, char *path) {
+	struct ext2_dir_entry_2 *entry = navigate(disk, path);
+	if (!entry) {
+		fprintf(stderr, "No such file or directory\n");
+		return ENOENT;
+	}
+
+	if (!EXT2_IS_DIRECTORY(entry)) {
+		fprintf(stderr, "%s is not a directory\n", path);
+		return ENOTDIR;
+	}
+
+	int res = dx_build(disk, get_inode(disk, entry->inode));
+	if (res) {
+		fprintf(stderr, "%s is too big to index\n", path);
+	}
+	return res;
+}
+
+#ifndef EXT2_NO_MAIN
+int main(int argc, char *argv[]) {
+	argc = image_options(argc, argv);
+	if (argc == 3) {
+		unsigned char *disk = read_image(argv[1], EXT2_ACCESS_WRITE);
+		return ext2_index(disk, argv[2]);
+	}
+
+	fprintf(stderr, usage, argv[0]);
+	return 1;
+}
+#endif
@@ -3,9 +3,15 @@
 #include <time.h>
 #include "ext2_welp.h"
 
-char *usage = "USAGE: %s disk [-s] target_path link_name\n";
-
-void create_soft(unsigned char *disk, struct ext2_inode *entry, char *path) {
+#ifndef EXT2_NO_MAIN
+char *usage = "USAGE: %s [--journal] [--sync=none|range|full] disk [-s] target_path link_name\n";
+#endif
+
+/*
+ * Writes the target of a symlink. Ones shorter than i_block go in it, with no
+ * block of their own, else it gets a block. Returns ENOSPC if there isn't one
+ */
+int create_soft(unsigned char *disk, unsigned int number, struct ext2_inode *entry, char *path) {
     int len = strlen(path);
     char *_path = path;
 
@@ -16,13 +22,37 @@ void create_soft(unsigned char *disk, struct ext2_inode *entry, char *path) {
     }
 
 	// Remove suffix /
-    if (path[len - 1] == '/') {
+    if (len && _path[len - 1] == '/') {
         len--;
     }
 
-	// Add ze link
-    memcpy(EXT2_BLOCK(disk, entry->i_block[0]), _path, len);
+	// Fast symlink
     entry->i_size = len;
+    if ((size_t)len < EXT2_FAST_LINK_MAX) {
+        memset(entry->i_block, 0, sizeof(entry->i_block));
+        memcpy(entry->i_block, _path, len);
+        EXT2_SET_BLOCKS(entry, 0);
+        mark_inode(disk, entry);
+        return 0;
+    }
+
+	// Get block
+    int block_index = get_free_block(disk, inode_group(disk, number));
+    if (block_index < 0) {
+        fprintf(stderr, "No space left on disk\n");
+        entry->i_size = 0;
+        mark_inode(disk, entry);
+        return ENOSPC;
+    }
+    set_block_bitmap(disk, block_index, 1);
+    EXT2_SET_BLOCKS(entry, 1);
+    entry->i_block[0] = block_index;
+
+	// Add ze link
+    memcpy(EXT2_BLOCK(disk, block_index), _path, len);
+    mark_dirty(disk, EXT2_BLOCK(disk, block_index), len);
+    mark_inode(disk, entry);
+    return 0;
 }
 
 int ext2_ln(unsigned char *disk, char *src, char *target, unsigned is_soft) {
@@ -56,53 +86,49 @@ int ext2_ln(unsigned char *disk, char *src, char *target, unsigned is_soft) {
 	}
 
 	char *filename = get_filename(src);
-	
+	int res = 0;
+
 	if (is_soft) {
 		struct ext2_dir_entry_2 *new_soft_link = add_thing(disk, source_entry, filename, EXT2_FT_SYMLINK);
 		struct ext2_inode *inode = get_inode(disk, new_soft_link->inode);
 
-		// Get block
-		int block_index = get_free_block(disk);
-		set_block_bitmap(disk, block_index, 1);
-
 		// Setup inode
-		EXT2_SET_BLOCKS(inode, 1);
-		inode->i_block[0] = block_index;
 		inode->i_mode = EXT2_S_IFLNK;
 		inode->i_links_count = 1;
 		inode->i_ctime = time(0);
 		inode->i_atime = time(0);
 		inode->i_mtime = time(0);
 
-		// Write into block
-		create_soft(disk, inode, target);
+		// Write the target
+		res = create_soft(disk, new_soft_link->inode, inode, target);
 
 	} else {
-		struct ext2_dir_entry_2 *new_hard_link = add_thing(disk, source_entry, filename, EXT2_FT_REG_FILE);
-		struct ext2_inode *inode = get_inode(disk, source_entry->inode);
+		struct ext2_inode *inode = get_inode(disk, target_entry->inode);
 
-		// Free inode from add
-		set_inode_bitmap(disk, new_hard_link->inode, 0);
-		new_hard_link->inode = target_entry->inode;
+		// Another entry for the same inode
+		add_link(disk, source_entry, filename, target_entry->file_type, target_entry->inode);
 		inode->i_links_count++;
+		mark_inode(disk, inode);
 	}
 
 	free(filename);
-	return 0;
+	return res;
 }
 
 
+#ifndef EXT2_NO_MAIN
 int main(int argc, char *argv[]) {
+	argc = image_options(argc, argv);
 	unsigned char *disk;
 
 	// If hard link
 	if (argc == 4) {
-		disk = read_image(argv[1]);
+		disk = read_image(argv[1], EXT2_ACCESS_WRITE);
 		return ext2_ln(disk, argv[2], argv[3], 0);
 	
 	// If soft link
 	} else if (argc == 5 && strcmp(argv[2], "-s") == 0) {
-		disk = read_image(argv[1]);
+		disk = read_image(argv[1], EXT2_ACCESS_WRITE);
 		return ext2_ln(disk, argv[3], argv[4], 1);
 	}
 
@@ -110,3 +136,4 @@ int main(int argc, char *argv[]) {
 	fprintf(stderr, usage, argv[0]);
 	return 1;
 }
+#endif
@@ -1,18 +1,160 @@
 #include <stdio.h>
+#include <time.h>
+#include <unistd.h>
 #include "ext2_welp.h"
 
-char *usage = "USAGE: %s disk [-a] path\n";
+#ifndef EXT2_NO_MAIN
+char *usage = "USAGE: %s disk [-alRs] path\n"
+	"  -s sorts by name, entries are otherwise listed as stored (not sizes, as in ls)\n";
+#endif
 
-int print(struct ext2_dir_entry_2 *block, void *flag_a) {
-	char *name = get_name(block);
-	if (*(int *)flag_a || (strcmp(name, ".") != 0 && strcmp(name, "..") != 0)) {
-		printf("%s\n", name);
+// What to show, see ls_flags
+#define LS_ALL 1            // -a: . and .. too
+#define LS_LONG 2           // -l: inode, mode, links, size and mtime before the name
+#define LS_RECURSIVE 4      // -R: and everything under each directory
+#define LS_SORT 8           // -s: by name, rather than as stored
+
+/*
+ * Reads flags like -alR into flags. Returns 0 if it isn't flags
+ */
+int ls_flags(char *arg, int *flags) {
+	if (arg[0] != '-' || !arg[1]) return 0;
+
+	for (arg++; *arg; arg++) {
+		if (*arg == 'a') {
+			*flags |= LS_ALL;
+		} else if (*arg == 'l') {
+			*flags |= LS_LONG;
+		} else if (*arg == 'R') {
+			*flags |= LS_RECURSIVE;
+		} else if (*arg == 's') {
+			*flags |= LS_SORT;
+		} else {
+			return 0;
+		}
 	}
-	free(name);
 	return 1;
 }
 
-int ext2_ls(unsigned char *disk, char *path, int flag_a) {
+/*
+ * Puts out one entry, just the name or the long form
+ */
+void ls_print(unsigned char *disk, struct ext2_out *out, int flags, const char *name, unsigned int len, unsigned int number) {
+	char line[EXT2_NAME_LEN + 128];
+	const char *target = NULL;
+	unsigned int target_len = 0;
+	int size = 0;
+
+	if (flags & LS_LONG) {
+		struct ext2_inode *inode = get_inode(disk, number);
+		unsigned short mode = inode->i_mode;
+		char perms[11] = "----------", when[32];
+		const char *rwx = "rwxrwxrwx";
+		time_t mtime = inode->i_mtime;
+		struct tm tm;
+		int i;
+
+		if ((mode & 0xF000) == EXT2_S_IFDIR) perms[0] = 'd';
+		if ((mode & 0xF000) == EXT2_S_IFLNK) {
+			perms[0] = 'l';
+			target = link_target(disk, inode);
+			target_len = EXT2_IS_FAST_LINK(inode) ? EXT2_FAST_LINK_MAX : EXT2_BLOCK_SIZE;
+			target_len = MIN(inode->i_size, target_len);
+		}
+		for (i = 0; i < 9; i++) {
+			if (mode & (0400 >> i)) perms[i + 1] = rwx[i];
+		}
+		strftime(when, sizeof(when), "%Y-%m-%d %H:%M", localtime_r(&mtime, &tm));
+
+		size = snprintf(line, sizeof(line), "%8u %s %3u %10u %s ", number, perms, inode->i_links_count, inode->i_size, when);
+	}
+
+	memcpy(line + size, name, len);
+	size += len;
+
+	// Where a symlink goes, which may not fit in line
+	if (target) {
+		memcpy(line + size, " -> ", 4);
+		out_write(out, line, size + 4);
+		out_write(out, target, target_len);
+		size = 0;
+	}
+
+	line[size] = '\n';
+	out_write(out, line, size + 1);
+}
+
+/*
+ * An entry of a directory being listed, pointing into the image
+ */
+struct ls_entry {
+	const char *name;
+	unsigned int len;
+	unsigned int inode;
+	unsigned char type;
+};
+
+int ls_entry_cmp(const void *a, const void *b) {
+	const struct ls_entry *x = a, *y = b;
+	int res = memcmp(x->name, y->name, MIN(x->len, y->len));
+	return res ? res : (int)x->len - (int)y->len;
+}
+
+/*
+ * Lists the directory at path with inode number, and with -R everything under it
+ */
+void ls_dir(unsigned char *disk, struct ext2_out *out, int flags, char *path, unsigned int number) {
+	struct ls_entry *entries = NULL;
+	struct ext2_dir_entry_2 *entry;
+	struct ext2_dir_iter it;
+	size_t count = 0, size = 0, i;
+
+	dir_iter_init(&it, disk, get_inode(disk, number));
+	while ((entry = dir_iter_next(&it))) {
+		if (!entry->inode || (!(flags & LS_ALL) && name_is_dots(entry_name(entry)))) continue;
+
+		if (count == size) {
+			size = size ? size * 2 : 64;
+			entries = realloc(entries, size * sizeof(struct ls_entry));
+			assert(entries);
+		}
+		entries[count].name = entry->name;
+		entries[count].len = entry->name_len;
+		entries[count].inode = entry->inode;
+		entries[count].type = entry->file_type;
+		count++;
+	}
+	if (flags & LS_SORT) qsort(entries, count, sizeof(struct ls_entry), ls_entry_cmp);
+
+	if (flags & LS_RECURSIVE) {
+		out_write(out, path, strlen(path));
+		out_write(out, ":\n", 2);
+	}
+	for (i = 0; i < count; i++) {
+		ls_print(disk, out, flags, entries[i].name, entries[i].len, entries[i].inode);
+	}
+
+	// Then each directory in it, in the same order
+	for (i = 0; i < count && (flags & LS_RECURSIVE) && !out->error; i++) {
+		if (entries[i].type != EXT2_FT_DIR || name_is_dots((struct ext2_name){ entries[i].name, entries[i].len })) continue;
+
+		size_t len = strlen(path);
+		char *child = malloc(len + entries[i].len + 2);
+		assert(child);
+		memcpy(child, path, len);
+		if (!len || path[len - 1] != '/') child[len++] = '/';
+		memcpy(child + len, entries[i].name, entries[i].len);
+		child[len + entries[i].len] = '\0';
+
+		out_write(out, "\n", 1);
+		ls_dir(disk, out, flags, child, entries[i].inode);
+		free(child);
+	}
+	free(entries);
+}
+
+int ext2_ls(unsigned char *disk, char *path, int flags) {
+	static struct ext2_out out;
 
 	// Navigate to the directory of path
 	struct ext2_dir_entry_2 *entry = navigate(disk, path);
@@ -21,40 +163,38 @@ int ext2_ls(unsigned char *disk, char *path, int flag_a) {
 		return ENOENT;
 	}
 
+	// Anything already in stdio has to go first
+	fflush(stdout);
+	out_init(&out, STDOUT_FILENO);
+
 	// If directory, print it, else the file itself
 	if (EXT2_IS_DIRECTORY(entry)) {
-		struct ext2_inode *inode = get_inode(disk, entry->inode);
-		iterate_inode(disk, inode, print, &flag_a);
+		ls_dir(disk, &out, flags, path, entry->inode);
 	} else {
-		char *name = get_name(entry);
-		printf("%s\n", name);
-		free(name);
+		ls_print(disk, &out, flags, entry->name, entry->name_len, entry->inode);
 	}
+	out_flush(&out);
 
+	if (out.error) {
+		fprintf(stderr, "stdout: %s\n", strerror(out.error));
+		return out.error;
+	}
 	return 0;
 }
 
+#ifndef EXT2_NO_MAIN
 int main(int argc, char *argv[]) {
-	unsigned char *disk;
-	int flag_a = 0;
-	char *path;
-
-	// If run without -a argument
-	if (argc == 3 && strcmp(argv[2], "-a") != 0) {
-		disk = read_image(argv[1]);
-		path = argv[2];
-
-	// If run with -a argument
-	} else if (argc == 4 && strcmp(argv[2], "-a") == 0) {
-		disk = read_image(argv[1]);
-		path = argv[3];
-		flag_a = 1;
-	
-	// Anything else
-	} else {
+	argc = image_options(argc, argv);
+	int flags = 0, i;
+
+	// Flags, then the path
+	for (i = 2; i < argc - 1 && ls_flags(argv[i], &flags); i++);
+	if (argc < 3 || i != argc - 1) {
 		fprintf(stderr, usage, argv[0]);
 		return 1;
 	}
 
-	return ext2_ls(disk, path, flag_a);
-}
\ No newline at end of file
+	unsigned char *disk = read_image(argv[1], EXT2_ACCESS_READ);
+	return ext2_ls(disk, argv[i], flags);
+}
+#endif
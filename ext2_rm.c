@@ -6,37 +6,42 @@
 #include "ext2.h"
 #include "ext2_welp.h"
 
-char *usage = "USAGE: %s disk path\n";
+#ifndef EXT2_NO_MAIN
+char *usage = "USAGE: %s [--journal] [--sync=none|range|full] disk path\n";
+#endif
 
-int main(int argc, char *argv[]) {
+int ext2_rm(unsigned char *disk, char *path) {
 	struct ext2_dir_entry_2 *entry, *dir;
-	unsigned char *disk;
-	char *path;
 
-	if (argc == 3)	{
-		disk = read_image(argv[1]);
-		path = argv[2];
-		
-		// Check path
-		entry = navigate(disk, path);
-		if (!entry) {
-			fprintf(stderr, "'%s': Invalid file or directory\n", path);
-			return ENOENT;
-		}
-		if (EXT2_IS_DIRECTORY(entry)) {
-			fprintf(stderr, "'%s': Is a directory\n", path);
-			return EISDIR;
-		}
+	// Check path
+	entry = navigate(disk, path);
+	if (!entry) {
+		fprintf(stderr, "'%s': Invalid file or directory\n", path);
+		return ENOENT;
+	}
+	if (EXT2_IS_DIRECTORY(entry)) {
+		fprintf(stderr, "'%s': Is a directory\n", path);
+		return EISDIR;
+	}
 
-		// Get directory containing file
-		path = get_dir(path);
-		dir = navigate(disk, path);
-		free(path);
+	// Get directory containing file
+	path = get_dir(path);
+	dir = navigate(disk, path);
+	free(path);
 
-		remove_entry(disk, dir, entry);
-		return 0;
+	remove_entry(disk, dir, entry);
+	return 0;
+}
+
+#ifndef EXT2_NO_MAIN
+int main(int argc, char *argv[]) {
+	argc = image_options(argc, argv);
+	if (argc == 3)	{
+		unsigned char *disk = read_image(argv[1], EXT2_ACCESS_WRITE);
+		return ext2_rm(disk, argv[2]);
 	}
 
 	fprintf(stderr, usage, argv[0]);
 	return 1;
 }
+#endif
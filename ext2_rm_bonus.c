@@ -3,9 +3,17 @@
 #include <errno.h>
 #include "ext2.h"
 #include "ext2_welp.h"
-char *usage = "USAGE: %s disk [-r] path\n";
+
+#ifndef EXT2_NO_MAIN
+char *usage = "USAGE: %s [--journal] [--sync=none|range|full] disk [-r] [-j workers] path\n";
+#endif
 
 int remove_file_or_dir(unsigned char *disk, char *path, int r_flag) {
+	if (strcmp(path, "/") == 0) {
+		fprintf(stderr, "Cannot delete root directory\n");
+		return EPERM;
+	}
+
 	// Get entry
 	struct ext2_dir_entry_2 *entry = navigate(disk, path);
 	if (!entry) {
@@ -13,26 +21,44 @@ int remove_file_or_dir(unsigned char *disk, char *path, int r_flag) {
 		return ENOENT;
 	}
 
+	if (EXT2_IS_DIRECTORY(entry) && !r_flag) {
+		fprintf(stderr, "'%s': Is a directory\n", path);
+		return EISDIR;
+	}
+
 	// Get dir
 	path = get_dir(path);
 	struct ext2_dir_entry_2 *dir = navigate(disk, path);
 	free(path);
-	
-	// Remove thing
+
+	// Remove thing, whole directories in parallel
 	remove_entry(disk, dir, entry);
 	return 0;
 }
 
+#ifndef EXT2_NO_MAIN
 int main(int argc, char *argv[]) {
+	argc = image_options(argc, argv);
 	unsigned char *disk;
 	unsigned r_flag = 0;
 	char *path;
+	int i, left = 1;
+
+	// How many workers remove directories, wherever it's given
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-j") && i + 1 < argc) {
+			remove_workers = atoi(argv[++i]);
+		} else {
+			argv[left++] = argv[i];
+		}
+	}
+	argc = left;
 
 	if (argc == 3) {
-		disk = read_image(argv[1]);
+		disk = read_image(argv[1], EXT2_ACCESS_WRITE);
 		path = argv[2];
 	} else if (argc == 4 && !strcmp("-r", argv[2])) {
-		disk = read_image(argv[1]);
+		disk = read_image(argv[1], EXT2_ACCESS_WRITE);
 		path = argv[3];
 		r_flag = 1;
 	} else {
@@ -40,12 +66,6 @@ int main(int argc, char *argv[]) {
 		return 1;
 	}
 
-	if (strcmp(path, "/") == 0) {
-		fprintf(stderr, "Cannot delete root directory\n");
-		return EPERM;
-	}
-
 	return remove_file_or_dir(disk, path, r_flag);
 }
-
-
+#endif
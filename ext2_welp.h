@@ -1,16 +1,33 @@
+#ifndef CSC369A3_EXT2_WELP_H
+#define CSC369A3_EXT2_WELP_H
+
+#include <sys/file.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <assert.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <errno.h>
+#include <stdarg.h>
 #include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
 #include <time.h>
+#include <pthread.h>
 #include "ext2.h"
 
 
-#define EXT2_GROUP_DESC(disk) ((struct ext2_group_desc *)(disk + (EXT2_BLOCK_SIZE * 2)))
-#define EXT2_SUPER_BLOCK(disk) ((struct ext2_super_block *)(disk + EXT2_BLOCK_SIZE))
+#define EXT2_GROUP_DESC(disk) ((struct ext2_group_desc *)EXT2_BLOCK(disk, EXT2_SUPER_BLOCK(disk)->s_first_data_block + 1))
+#define EXT2_SUPER_BLOCK(disk) ((struct ext2_super_block *)(disk + EXT2_MIN_BLOCK_SIZE))
+#define EXT2_SUPER_MAGIC 0xEF53
+#define EXT2_GROUP_COUNT(disk) ((EXT2_SUPER_BLOCK(disk)->s_blocks_count - EXT2_SUPER_BLOCK(disk)->s_first_data_block + \
+    EXT2_SUPER_BLOCK(disk)->s_blocks_per_group - 1) / EXT2_SUPER_BLOCK(disk)->s_blocks_per_group)
+#define EXT2_FIRST_INO(disk) (EXT2_SUPER_BLOCK(disk)->s_rev_level ? EXT2_SUPER_BLOCK(disk)->s_first_ino : EXT2_GOOD_OLD_FIRST_INO)
+#define EXT2_INODE_SIZE(disk) (EXT2_SUPER_BLOCK(disk)->s_rev_level ? EXT2_SUPER_BLOCK(disk)->s_inode_size : sizeof(struct ext2_inode))
+#define EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER 0x0001  /* Only some groups have superblock copies */
+// s_reserved_gdt_blocks isn't in our superblock struct, it's s_padding1
+#define EXT2_RESERVED_GDT_BLOCKS(sb) ((sb)->s_padding1)
 
 // Helpful stuff
 #define MULTIPLE_OF_FOUR(x) ((x) + ((4 - ((x)%4)) % 4))
@@ -19,12 +36,16 @@
 
 // Scalars
 #define EXT2_DIR_SIZE(name) MULTIPLE_OF_FOUR(sizeof(struct ext2_dir_entry_2) + strlen(name))
+#define EXT2_ENTRY_SIZE(entry) MULTIPLE_OF_FOUR(sizeof(struct ext2_dir_entry_2) + (entry)->name_len)
 #define EXT2_DIRECT_BLOCKS 12
+#define EXT2_INDIRECT_BLOCKS (EXT2_BLOCK_SIZE / sizeof(int))
+#define EXT2_MAX_BLOCKS (EXT2_DIRECT_BLOCKS + EXT2_INDIRECT_BLOCKS * (1 + EXT2_INDIRECT_BLOCKS * (1 + (uint64_t)EXT2_INDIRECT_BLOCKS)))
 
 // https://www.nongnu.org/ext2-doc/ext2.html#i-blocks
 #define EXT2_NUM_BLOCKS(disk, entry) (entry->i_blocks/(2 << (EXT2_SUPER_BLOCK(disk)->s_log_block_size)))
+#define EXT2_DIR_BLOCKS(entry) (entry->i_size / EXT2_BLOCK_SIZE)
 #define EXT2_NEXT_FILE(entry) ((struct ext2_dir_entry_2 *)((char *)entry + entry->rec_len))
-#define EXT2_BLOCK(disk, x) (disk + (EXT2_BLOCK_SIZE * x))
+#define EXT2_BLOCK(disk, x) (disk + (size_t)EXT2_BLOCK_SIZE * (x))
 #define EXT2_SET_BLOCKS(entry, x) (entry->i_blocks = (x) * (2 << (EXT2_SUPER_BLOCK(disk)->s_log_block_size)))
 #define SET_BIT_1(map, index) (map[index / 8] |= (1 << index % 8))
 #define SET_BIT_0(map, index) (map[index / 8] &= ~(1 << index % 8))
@@ -34,487 +55,2469 @@
 #define EXT2_IS_FILE(entry) ((entry != NULL) && (entry->file_type == EXT2_FT_REG_FILE))
 #define EXT2_IS_LINK(entry) ((entry != NULL) && (entry->file_type == EXT2_FT_SYMLINK))
 
+// Symlinks with targets shorter than i_block keep them in it, and have no blocks
+#define EXT2_FAST_LINK_MAX sizeof(((struct ext2_inode *)0)->i_block)
+#define EXT2_IS_FAST_LINK(inode) ((((inode)->i_mode & 0xF000) == EXT2_S_IFLNK) && !(inode)->i_blocks)
+
+/*
+ * A name in a directory entry (or anywhere else), seen in place rather than copied
+ */
+struct ext2_name {
+    const char *ptr;
+    unsigned int len;
+};
+
 void remove_dir(unsigned char *, struct ext2_dir_entry_2 *);
+int set_block_size(unsigned int);
+void alloc_commit(unsigned char *);
+
+// Directory index, see ext2_htree.h
+#define EXT2_INDEX_FL 0x00001000              /* Directory has a hashed index */
+#define EXT2_FEATURE_COMPAT_DIR_INDEX 0x0020  /* Some directories have an index */
+#define EXT2_DX_MIN_BLOCKS 4                  /* Index directories this big, with the feature on */
+
+int dx_is_indexed(unsigned char *, struct ext2_inode *);
+int dx_find(unsigned char *, struct ext2_inode *, struct ext2_name, struct ext2_dir_entry_2 **);
+struct ext2_dir_entry_2 *dx_add(unsigned char *, struct ext2_inode *, char *, int);
+int dx_build(unsigned char *, struct ext2_inode *);
+
+// How a tool is going to go through the image, see open_image
+#define EXT2_MAP_METADATA 0     // Mostly inodes and directories
+#define EXT2_MAP_SEQUENTIAL 1   // Mostly streaming file data
+
+// What a tool is going to do to the image, see open_image
+#define EXT2_ACCESS_READ 0      // Only looks, alongside any other readers
+#define EXT2_ACCESS_WRITE 1     // Changes it, with nothing else looking
+
+#define EXT2_POPULATE_MAX (16 << 20)   // Fault in all of images up to this big
+#define EXT2_HUGEPAGE_MIN (64 << 20)   // Ask for huge pages on images this big
+
+#define EXT2_JOURNAL_MAGIC 0x4A324558    // "EX2J", starts a transaction
+#define EXT2_JOURNAL_COMMIT 0x43324558   // "EX2C", ends one that made it to disk
+#define EXT2_JOURNAL_MAX 8192            // Write out once this many blocks are waiting
+
+// What each command does to get its changes to disk, see ext2_commit
+#define EXT2_SYNC_NONE 0        // Leave it to the kernel
+#define EXT2_SYNC_RANGE 1       // msync the blocks it changed
+#define EXT2_SYNC_FULL 2        // msync the whole image
+
+size_t image_size;
+unsigned char *image_disk;      // What ext2_commit writes back
+int image_fd = -1;              // Kept open while journaling
+int image_journal;              // --journal given
+int image_sync = EXT2_SYNC_NONE;
+unsigned int ext2_block_size = EXT2_MIN_BLOCK_SIZE;
 
 /*
- * Read image from image file
+ * Takes the options every tool has out of argv, wherever they are, and
+ * returns what's left of argc. They're only for tools that write, the ones
+ * that only read take them but have nothing to do with them
  */
-unsigned char *read_image(char *image) {
-    int fd = open(image, O_RDWR);
-    unsigned char *disk = mmap(NULL, 128 * EXT2_BLOCK_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    if (disk == MAP_FAILED) {
-        perror("mmap");
-        exit(1);
+int image_options(int argc, char *argv[]) {
+    int i, left = 1;
+    for (i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--journal")) {
+            image_journal = 1;
+        } else if (!strcmp(argv[i], "--sync=none")) {
+            image_sync = EXT2_SYNC_NONE;
+        } else if (!strcmp(argv[i], "--sync=range")) {
+            image_sync = EXT2_SYNC_RANGE;
+        } else if (!strcmp(argv[i], "--sync=full")) {
+            image_sync = EXT2_SYNC_FULL;
+        } else if (!strncmp(argv[i], "--sync=", 7)) {
+            fprintf(stderr, "%s: expected none, range or full\n", argv[i]);
+            exit(1);
+        } else {
+            argv[left++] = argv[i];
+        }
     }
-    return disk;
+    argv[left] = NULL;
+    return left;
 }
 
-char *get_name(struct ext2_dir_entry_2 *entry) {
-    char *name = (char *)malloc(entry->name_len + 1);
-    strncpy(name, entry->name, entry->name_len);
-    name[entry->name_len] = '\0';
-    return name;
+/*
+ * Blocks written since the image was last synced, a bit for each. Data is file
+ * content, which the journal writes straight to the image, and freed is what
+ * was let go of since, which mustn't be overwritten in place until that's on disk
+ */
+struct ext2_dirty {
+    uint64_t *map;
+    uint64_t *data;
+    uint64_t *freed;
+    unsigned int blocks;
+};
+
+struct ext2_dirty dirty_blocks;
+
+void dirty_init(unsigned int blocks) {
+    size_t words = (blocks + 63) / 64;
+    dirty_blocks.map = calloc(words, sizeof(uint64_t));
+    dirty_blocks.data = calloc(words, sizeof(uint64_t));
+    dirty_blocks.freed = calloc(words, sizeof(uint64_t));
+    assert(dirty_blocks.map && dirty_blocks.data && dirty_blocks.freed);
+    dirty_blocks.blocks = blocks;
 }
 
-char *get_dir(char *path) {
-	char *_path = (char *)malloc(strlen(path) + 1);
-	strncpy(_path, path, strlen(path) + 1);
-
-	char *token = strtok(_path, "/");
-	char *_token = NULL;
-	int i = 1;
-
-	do {
-		_token = strtok(NULL, "/");
-		if (_token) {
-			i += strlen(token) + 1;
-			token = _token;
-		}
-	} while (_token);
+/*
+ * Sets (or clears) the bits of len blocks from first in a map. Workers in
+ * ext2_rm_bonus mark blocks too, so each word is changed atomically
+ */
+void dirty_set(uint64_t *map, unsigned int first, unsigned int len, int state) {
+    unsigned int end = MIN(first + len, dirty_blocks.blocks), w;
+    uint64_t mask;
+    if (first >= end) return;
 
-	strncpy(_path, path, i);
-	_path[i - 1] = '\0';
+    for (w = first / 64; w <= (end - 1) / 64; w++) {
+        mask = ~0ULL;
+        if (w == first / 64) mask &= ~0ULL << first % 64;
+        if (w == (end - 1) / 64 && end % 64) mask &= ~0ULL >> (64 - end % 64);
 
-	return _path;
+        if (state) {
+            __atomic_fetch_or(&map[w], mask, __ATOMIC_RELAXED);
+        } else {
+            __atomic_fetch_and(&map[w], ~mask, __ATOMIC_RELAXED);
+        }
+    }
 }
 
-char *get_filename(char *path) {
-    char *_path = (char *)malloc(strlen(path) + 1);
-    strncpy(_path, path, strlen(path) + 1);
-	char *token = strtok(_path, "/");
-	char *_token;
-
-	do {
-		_token = strtok(NULL, "/");
-		if (_token) token = _token;
-	} while (_token);
+/*
+ * Notes that the len bytes at ptr in the image were changed. Anything but file
+ * content goes through here
+ */
+void mark_dirty(unsigned char *disk, void *ptr, size_t len) {
+    if (!dirty_blocks.map || !len) return;
+
+    size_t start = (unsigned char *)ptr - disk;
+    unsigned int first = start / EXT2_BLOCK_SIZE;
+    unsigned int last = (start + len - 1) / EXT2_BLOCK_SIZE;
+    dirty_set(dirty_blocks.map, first, last - first + 1, 1);
+    dirty_set(dirty_blocks.data, first, last - first + 1, 0);
+}
 
-    strncpy(_path, token, strlen(token) + 1);
-	return _path;
+void mark_inode(unsigned char *disk, struct ext2_inode *inode) {
+    mark_dirty(disk, inode, EXT2_INODE_SIZE(disk));
 }
 
 /*
- * Given inode number, get inode
+ * Notes that len blocks from first were filled with file content
  */
-struct ext2_inode *get_inode(unsigned char *disk, unsigned int number) {
-    struct ext2_group_desc *desc = EXT2_GROUP_DESC(disk);
-    struct ext2_inode *table = (struct ext2_inode *)EXT2_BLOCK(disk, desc->bg_inode_table);
-    return &table[number - 1];
+void mark_data(unsigned char *disk, unsigned int first, unsigned int len) {
+    if (!dirty_blocks.map) return;
+    dirty_set(dirty_blocks.map, first, len, 1);
+    dirty_set(dirty_blocks.data, first, len, 1);
 }
 
 /*
- * Gets the blocks with corespond to the inode
+ * Notes that len blocks from first were freed
  */
-int *inode_to_blocks(unsigned char *disk, struct ext2_inode *entry) {
-    // If no blocks, ignore
-    if (!entry->i_block) return NULL;
+void mark_freed(unsigned char *disk, unsigned int first, unsigned int len) {
+    if (!dirty_blocks.map) return;
+    dirty_set(dirty_blocks.freed, first, len, 1);
+}
 
-    unsigned int limit = EXT2_NUM_BLOCKS(disk, entry);
-    int count = limit + (limit > EXT2_DIRECT_BLOCKS ? (EXT2_BLOCK_SIZE / sizeof(int)) : 0);
-    int *blocks = malloc(count * sizeof(int));
-    assert(blocks);
+// Which dirty blocks dirty_run looks for
+#define EXT2_DIRTY_JOURNAL 0    // Through the journal
+#define EXT2_DIRTY_DATA 1       // Straight to the image
+#define EXT2_DIRTY_ALL 2
 
-    // Clean blocks
-    memset(blocks, '\0', count * sizeof(int));
+/*
+ * Dirty blocks in word w of a kind. Data in a block freed since the last sync
+ * still goes through the journal, since the old owner might need it back after
+ * a crash
+ */
+uint64_t dirty_word(unsigned int w, int kind) {
+    uint64_t in_place = dirty_blocks.data[w] & ~dirty_blocks.freed[w];
+    if (kind == EXT2_DIRTY_ALL) return dirty_blocks.map[w];
+    return dirty_blocks.map[w] & (kind == EXT2_DIRTY_DATA ? in_place : ~in_place);
+}
 
-    // Load direct blocks
-    memcpy(blocks, entry->i_block, MIN(EXT2_DIRECT_BLOCKS, limit) * sizeof(int));
+/*
+ * Finds the next run of dirty blocks of a kind from block from. Returns its
+ * first block and sets len, which is 0 when there are no more
+ */
+unsigned int dirty_run(unsigned int from, int kind, unsigned int *len) {
+    unsigned int words = (dirty_blocks.blocks + 63) / 64, w = from / 64, start, end;
+    uint64_t word = w < words ? dirty_word(w, kind) & (~0ULL << from % 64) : 0;
+
+    *len = 0;
+    while (!word) {
+        if (++w >= words) return dirty_blocks.blocks;
+        word = dirty_word(w, kind);
+    }
+    start = w * 64 + __builtin_ctzll(word);
 
-    // If theres an indirect, copy that into the array
-    if (limit > EXT2_DIRECT_BLOCKS) {
-        memcpy(
-            blocks + EXT2_DIRECT_BLOCKS, // Shift passed first 12 blocks
+    word = ~dirty_word(w, kind) & (~0ULL << start % 64);
+    while (!word && ++w < words) {
+        word = ~dirty_word(w, kind);
+    }
+    end = w < words ? w * 64 + __builtin_ctzll(word) : dirty_blocks.blocks;
+    *len = MIN(end, dirty_blocks.blocks) - start;
+    return start;
+}
 
-            // Get blocks 13 - 268 from indirect, https://www.nongnu.org/ext2-doc/ext2.html#i-block
-            EXT2_BLOCK(disk, entry->i_block[EXT2_DIRECT_BLOCKS]),
-            EXT2_BLOCK_SIZE
-        );
+unsigned int dirty_count() {
+    unsigned int words = (dirty_blocks.blocks + 63) / 64, w, count = 0;
+    for (w = 0; w < words; w++) {
+        count += __builtin_popcountll(dirty_blocks.map[w]);
     }
+    return count;
+}
 
-    return blocks;
+void dirty_clear() {
+    size_t bytes = (dirty_blocks.blocks + 63) / 64 * sizeof(uint64_t);
+    memset(dirty_blocks.map, 0, bytes);
+    memset(dirty_blocks.data, 0, bytes);
+    memset(dirty_blocks.freed, 0, bytes);
 }
 
 /*
- * Sets bit, and count, for bitmap of a thing
+ * A transaction in the journal is this header, the block numbers, the blocks,
+ * then the header again with the commit magic. It only counts once the commit
+ * is there and the checksum matches, and is gone again once it's in the image
  */
-int set_thing_bitmap(unsigned char *disk, unsigned int index, unsigned state, unsigned char *map, unsigned short *count, unsigned short *sb_count) {
-    unsigned bit = map[index / 8] & (1 << index % 8);
-    if (state && !*count) {
-        perror("bitmap: out of space");
-        exit(ENOSPC);
+struct ext2_journal_header {
+    uint32_t magic;
+    uint32_t block_size;
+    uint32_t count;
+    uint32_t checksum;          // FNV-1a of the block numbers and blocks
+};
+
+char *journal_path;
+int journal_fd = -1;
+
+uint32_t journal_checksum(uint32_t hash, const unsigned char *data, size_t len) {
+    size_t i;
+    for (i = 0; i < len; i++) {
+        hash = (hash ^ data[i]) * 16777619u;
     }
+    return hash;
+}
 
-    if (bit != state) {
-        if (state) {
-            SET_BIT_1(map, index);
-            (*sb_count)--;
-            (*count)--;
-        } else {
-            SET_BIT_0(map, index);
-            (*sb_count)++;
-            (*count)++;
-        }
+/*
+ * pwrite and pread all of it, carrying on after short ones. Returns 0 or errno
+ */
+int write_all(int fd, const void *data, size_t len, off_t offset) {
+    ssize_t res;
+    while (len) {
+        res = pwrite(fd, data, len, offset);
+        if (res < 0 && errno == EINTR) continue;
+        if (res <= 0) return res < 0 ? errno : EIO;
+        data = (const unsigned char *)data + res;
+        len -= res;
+        offset += res;
     }
+    return 0;
+}
 
+int read_all(int fd, void *data, size_t len, off_t offset) {
+    ssize_t res;
+    while (len) {
+        res = pread(fd, data, len, offset);
+        if (res < 0 && errno == EINTR) continue;
+        if (res <= 0) return res < 0 ? errno : EIO;
+        data = (unsigned char *)data + res;
+        len -= res;
+        offset += res;
+    }
     return 0;
 }
 
 /*
- * Sets bit, and count, for block bitmap
+ * Output gathered in one buffer and written when it fills up, for tools that
+ * print a line for everything on the image. error is the first errno from write
  */
-int set_block_bitmap(unsigned char *disk, unsigned int index, unsigned state) {
-    struct ext2_group_desc *desc = EXT2_GROUP_DESC(disk);
-    struct ext2_super_block *sb = EXT2_SUPER_BLOCK(disk);
-    unsigned char *bitmap = EXT2_BLOCK(disk, desc->bg_block_bitmap);
-    unsigned short sb_count = sb->s_free_blocks_count;
-    unsigned short count = desc->bg_free_blocks_count;
-    return set_thing_bitmap(disk, index, state, bitmap, &count, &sb_count);
+#define EXT2_OUT_SIZE (1 << 20)
+
+struct ext2_out {
+    int fd;
+    int error;
+    size_t len;
+    char buf[EXT2_OUT_SIZE];
+};
+
+void out_init(struct ext2_out *out, int fd) {
+    out->fd = fd;
+    out->error = 0;
+    out->len = 0;
+}
+
+void out_flush(struct ext2_out *out) {
+    size_t done = 0;
+    ssize_t res;
+
+    while (done < out->len && !out->error) {
+        res = write(out->fd, out->buf + done, out->len - done);
+        if (res < 0 && errno == EINTR) continue;
+        if (res <= 0) out->error = res < 0 ? errno : EIO;
+        else done += res;
+    }
+    out->len = 0;
+}
+
+void out_write(struct ext2_out *out, const void *data, size_t len) {
+    while (out->len + len > EXT2_OUT_SIZE) {
+        size_t part = EXT2_OUT_SIZE - out->len;
+        memcpy(out->buf + out->len, data, part);
+        out->len += part;
+        data = (const char *)data + part;
+        len -= part;
+        out_flush(out);
+    }
+    memcpy(out->buf + out->len, data, len);
+    out->len += len;
 }
 
 /*
- * Sets bit, and count, for inode bitmap
+ * printf into the buffer, flushing first if it didn't fit
  */
-int set_inode_bitmap(unsigned char *disk, unsigned int index, unsigned state) {
-    struct ext2_group_desc *desc = EXT2_GROUP_DESC(disk);
-    struct ext2_super_block *sb = EXT2_SUPER_BLOCK(disk);
-    unsigned char *bitmap = EXT2_BLOCK(disk, desc->bg_inode_bitmap);
-    unsigned short sb_count = sb->s_free_inodes_count;
-    unsigned short count = desc->bg_free_inodes_count;
-    return set_thing_bitmap(disk, index, state, bitmap, &count, &sb_count);
+void out_printf(struct ext2_out *out, const char *format, ...) {
+    va_list args, again;
+    int len;
+
+    va_start(args, format);
+    va_copy(again, args);
+    len = vsnprintf(out->buf + out->len, EXT2_OUT_SIZE - out->len, format, args);
+    if (len >= 0 && (size_t)len >= EXT2_OUT_SIZE - out->len) {
+        out_flush(out);
+        len = vsnprintf(out->buf, EXT2_OUT_SIZE, format, again);
+    }
+    if (len > 0) out->len += MIN((size_t)len, EXT2_OUT_SIZE - 1 - out->len);
+    va_end(again);
+    va_end(args);
 }
 
 /*
- * Searches provided bitmap for first free space 
+ * Reads the transaction in the journal, if it has one that was committed.
+ * Returns 1 and sets numbers and blocks if so
  */
-int get_free_thing(unsigned char *disk, unsigned short limit, unsigned char *map, unsigned int start) {
-    unsigned int i;
-    // Go through the bitmap
-    for (i = start; i < limit; i++) {
-        unsigned bit = map[i/8];
+int journal_load(int jfd, struct ext2_journal_header *header, uint32_t **numbers, unsigned char **blocks) {
+    struct ext2_journal_header commit;
+    uint32_t checksum = 2166136261u;
 
-        // If it's free, then return the inode
-        if ((bit & (1 << i%8)) == 0) {
-            return i;
-        }
+    if (read_all(jfd, header, sizeof(*header), 0) || header->magic != EXT2_JOURNAL_MAGIC ||
+        header->block_size < EXT2_MIN_BLOCK_SIZE || header->block_size > EXT2_MAX_BLOCK_SIZE) {
+        return 0;
     }
 
-    return -1;
+    size_t table = (size_t)header->count * sizeof(uint32_t), data = (size_t)header->count * header->block_size;
+    *numbers = malloc(table + 1);
+    *blocks = malloc(data + 1);
+    assert(*numbers && *blocks);
+    if (read_all(jfd, *numbers, table, sizeof(*header)) || read_all(jfd, *blocks, data, sizeof(*header) + table) ||
+        read_all(jfd, &commit, sizeof(commit), sizeof(*header) + table + data)) {
+        return 0;
+    }
+
+    checksum = journal_checksum(checksum, (unsigned char *)*numbers, table);
+    checksum = journal_checksum(checksum, *blocks, data);
+    return commit.magic == EXT2_JOURNAL_COMMIT && commit.count == header->count &&
+           commit.checksum == header->checksum && checksum == header->checksum;
 }
 
 /*
- * get the first free block
+ * Puts a committed transaction left in the journal by a crash into the image,
+ * before it's mapped. One that didn't get its commit is just dropped, the image
+ * never saw any of it
  */
-int get_free_block(unsigned char *disk) {
-    struct ext2_group_desc *desc = EXT2_GROUP_DESC(disk);
-    unsigned char *bitmap = EXT2_BLOCK(disk, desc->bg_block_bitmap);
-    unsigned int count = EXT2_SUPER_BLOCK(disk)->s_blocks_count;
-    return get_free_thing(disk, count, bitmap, 0);
+int journal_replay(int fd) {
+    struct ext2_journal_header header;
+    uint32_t *numbers = NULL, i;
+    unsigned char *blocks = NULL;
+    int res = 0;
+
+    int jfd = open(journal_path, O_RDWR);
+    if (jfd < 0) return errno == ENOENT ? 0 : errno;
+
+    if (journal_load(jfd, &header, &numbers, &blocks)) {
+        for (i = 0; i < header.count && !res; i++) {
+            res = write_all(fd, blocks + (size_t)i * header.block_size, header.block_size, (off_t)numbers[i] * header.block_size);
+        }
+        if (!res && fdatasync(fd)) res = errno;
+    }
+
+    // Replayed or no good, either way it's done with
+    if (!res && (ftruncate(jfd, 0) || fdatasync(jfd))) res = errno;
+    close(jfd);
+    free(numbers);
+    free(blocks);
+    return res;
 }
 
 /*
- * Get the first free inode
+ * Readers can't replay the journal, so they lay a committed transaction over a
+ * private mapping of size bytes instead, and see the image as it will be
  */
-int get_free_inode(unsigned char *disk) {
-    struct ext2_group_desc *desc = EXT2_GROUP_DESC(disk);
-    unsigned char *bitmap = EXT2_BLOCK(disk, desc->bg_inode_bitmap);
-    unsigned int count = EXT2_SUPER_BLOCK(disk)->s_inodes_count;
-    return get_free_thing(disk, count, bitmap, EXT2_GOOD_OLD_FIRST_INO);
+void journal_overlay(unsigned char *disk, size_t size) {
+    struct ext2_journal_header header;
+    uint32_t *numbers = NULL, i;
+    unsigned char *blocks = NULL;
+
+    int jfd = open(journal_path, O_RDONLY);
+    if (jfd < 0) return;
+
+    if (journal_load(jfd, &header, &numbers, &blocks)) {
+        for (i = 0; i < header.count; i++) {
+            size_t offset = (size_t)numbers[i] * header.block_size;
+            if (offset + header.block_size > size) continue;
+            memcpy(disk + offset, blocks + (size_t)i * header.block_size, header.block_size);
+        }
+    }
+    close(jfd);
+    free(numbers);
+    free(blocks);
 }
 
 /*
- * Go over all blocks, passing them one by one into the callback. If callback return 0,
- * then return block. else keep going. Your welcome...
+ * Writes the dirty runs of a kind to fd. Where they go in the image if offset is
+ * NULL, else one after the other from offset on
  */
-struct ext2_dir_entry_2 *iterate_inode(
-    unsigned char *disk,
-    struct ext2_inode *entry,
-    int (*callback)(struct ext2_dir_entry_2 *, void *),
-    void *params
-) {
-    int *blocks = inode_to_blocks(disk, entry);
-    int limit = EXT2_NUM_BLOCKS(disk, entry);
-    struct ext2_dir_entry_2 *block;
-    int i, j;
+int write_runs(int fd, unsigned char *disk, int kind, off_t *offset) {
+    unsigned int block, len;
+    int res = 0;
+
+    for (block = dirty_run(0, kind, &len); len && !res; block = dirty_run(block + len, kind, &len)) {
+        size_t size = (size_t)len * EXT2_BLOCK_SIZE;
+        res = write_all(fd, EXT2_BLOCK(disk, block), size, offset ? *offset : (off_t)block * EXT2_BLOCK_SIZE);
+        if (offset) *offset += size;
+    }
+    return res;
+}
 
-    // Loop through blocks
-    for (i = 0; i < limit; i++) {
-        block = (struct ext2_dir_entry_2 *)EXT2_BLOCK(disk, blocks[i]);
+/*
+ * Writes everything changed since the last time to the image, without a crash
+ * at any point leaving it inconsistent. File content goes straight to the image
+ * first, it's in blocks nothing on disk uses yet. The rest goes to the journal,
+ * which is synced before any of it reaches the image, then it's checkpointed
+ * into the image and the journal emptied. Everything since the last flush goes
+ * together, so a batch pays for the syncs once
+ */
+int journal_flush(unsigned char *disk) {
+    struct ext2_journal_header header = { EXT2_JOURNAL_MAGIC, EXT2_BLOCK_SIZE, 0, 2166136261u };
+    unsigned int block, len, i;
+    off_t offset = sizeof(header);
+    int res;
+
+    if (image_fd < 0 || journal_fd < 0 || !dirty_count()) return 0;
+
+    // Content in place, and synced before anything can point at it
+    res = write_runs(image_fd, disk, EXT2_DIRTY_DATA, NULL);
+    if (!res && fdatasync(image_fd)) res = errno;
+
+    // The rest into the journal, block numbers first
+    uint32_t *numbers = malloc(((size_t)dirty_count() + 1) * sizeof(uint32_t));
+    assert(numbers);
+    for (block = dirty_run(0, EXT2_DIRTY_JOURNAL, &len); len; block = dirty_run(block + len, EXT2_DIRTY_JOURNAL, &len)) {
+        for (i = 0; i < len; i++) {
+            numbers[header.count++] = block + i;
+        }
+    }
 
-        // Loop through entries in block
-        for (j = 0; j < EXT2_BLOCK_SIZE; block = EXT2_NEXT_FILE(block)) {
-            if ((*callback)(block, params) == 0) {
-                free(blocks);
-                return block;
-            }
-            j += block->rec_len;
+    if (!res && header.count) {
+        header.checksum = journal_checksum(header.checksum, (unsigned char *)numbers, header.count * sizeof(uint32_t));
+        for (block = dirty_run(0, EXT2_DIRTY_JOURNAL, &len); len; block = dirty_run(block + len, EXT2_DIRTY_JOURNAL, &len)) {
+            header.checksum = journal_checksum(header.checksum, EXT2_BLOCK(disk, block), (size_t)len * EXT2_BLOCK_SIZE);
         }
+
+        res = write_all(journal_fd, numbers, header.count * sizeof(uint32_t), offset);
+        offset += header.count * sizeof(uint32_t);
+        if (!res) res = write_runs(journal_fd, disk, EXT2_DIRTY_JOURNAL, &offset);
+
+        // Header and commit last, the transaction only counts once both are down
+        if (!res) res = write_all(journal_fd, &header, sizeof(header), 0);
+        header.magic = EXT2_JOURNAL_COMMIT;
+        if (!res) res = write_all(journal_fd, &header, sizeof(header), offset);
+        if (!res && fdatasync(journal_fd)) res = errno;
+
+        // Checkpoint. A crash from here on gets replayed from the journal
+        if (!res) res = write_runs(image_fd, disk, EXT2_DIRTY_JOURNAL, NULL);
+        if (!res && fdatasync(image_fd)) res = errno;
+        if (!res && (ftruncate(journal_fd, 0) || fdatasync(journal_fd))) res = errno;
     }
+    free(numbers);
 
-    free(blocks);
-    return NULL;
+    if (res) {
+        fprintf(stderr, "%s: %s\n", journal_path, strerror(res));
+        return res;
+    }
+
+    // The image has it all now, so the private copies of those pages can go
+    size_t page = sysconf(_SC_PAGESIZE);
+    for (block = dirty_run(0, EXT2_DIRTY_ALL, &len); len; block = dirty_run(block + len, EXT2_DIRTY_ALL, &len)) {
+        uintptr_t start = (uintptr_t)EXT2_BLOCK(disk, block), end = (uintptr_t)EXT2_BLOCK(disk, block + len);
+        start -= start % page;
+        madvise((void *)start, end - start, MADV_DONTNEED);
+    }
+    dirty_clear();
+    return 0;
 }
 
-int _find_file(struct ext2_dir_entry_2 *block, void *name) {
-    char *dir_name = get_name(block);
-    int res = strcmp(dir_name, (char *)name);
-    free(dir_name);
+/*
+ * msyncs the pages of the dirty blocks, a range at a time. Runs sharing or
+ * next to the same pages go together
+ */
+int msync_dirty(unsigned char *disk) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    uintptr_t start = 0, end = 0, from, to;
+    unsigned int block, len;
+    int res = 0;
+
+    for (block = dirty_run(0, EXT2_DIRTY_ALL, &len); len; block = dirty_run(block + len, EXT2_DIRTY_ALL, &len)) {
+        from = (uintptr_t)EXT2_BLOCK(disk, block);
+        to = (uintptr_t)EXT2_BLOCK(disk, block + len);
+        from -= from % page;
+
+        if (end && from <= end) {
+            end = MAX(end, to);
+            continue;
+        }
+        if (end && msync((void *)start, end - start, MS_SYNC)) res = errno;
+        start = from;
+        end = to;
+    }
+    if (end && msync((void *)start, end - start, MS_SYNC)) res = errno;
+
+    if (res) fprintf(stderr, "msync: %s\n", strerror(res));
+    dirty_clear();
     return res;
 }
+
 /*
- * Get directory from entry that matches name
+ * Makes everything committed so far durable, as --sync says. Journaling always
+ * goes through the journal
  */
-struct ext2_dir_entry_2 *find_file(unsigned char *disk, struct ext2_inode *entry, char *name) {
-    return iterate_inode(disk, entry, _find_file, name);
+void ext2_sync(void) {
+    if (!image_disk) return;
+
+    if (journal_fd >= 0) {
+        journal_flush(image_disk);
+    } else if (image_sync == EXT2_SYNC_RANGE) {
+        msync_dirty(image_disk);
+    } else if (image_sync == EXT2_SYNC_FULL && msync(image_disk, image_size, MS_SYNC)) {
+        perror("msync");
+    }
 }
 
 /*
- * Removes blocks from inode, and inode too if specified
+ * Finishes an operation on the image. Tools get this on the way out, whether
+ * they return or exit, batches after each command. Each one gets synced, except
+ * when journaling, where they're flushed together unless --sync=full
  */
-void free_blocks(unsigned char *disk, unsigned int inode) {
-    struct ext2_inode *file = get_inode(disk, inode);
-    int limit = EXT2_NUM_BLOCKS(disk, file);
-    int i;
+void ext2_commit(void) {
+    if (!image_disk) return;
+    alloc_commit(image_disk);
 
-    // Free direct blocks
-    for (i = 0; i < EXT2_DIRECT_BLOCKS && i < limit; i++) {
-        set_block_bitmap(disk, file->i_block[i], 0);
+    if (journal_fd < 0 || image_sync == EXT2_SYNC_FULL || dirty_count() >= EXT2_JOURNAL_MAX) {
+        ext2_sync();
     }
+}
 
-    // Free indirect block
-    if (limit >= EXT2_DIRECT_BLOCKS) {
+/*
+ * Last thing a tool does, from atexit
+ */
+void ext2_close(void) {
+    ext2_commit();
+    if (journal_fd >= 0) ext2_sync();
+}
 
-        // Free direct of indirect
-        set_block_bitmap(disk, file->i_block[EXT2_DIRECT_BLOCKS], 0);
-        int *block = (int *)EXT2_BLOCK(disk, file->i_block[EXT2_DIRECT_BLOCKS]);
+/*
+ * Maps the whole image, sized from the file and checked against the superblock,
+ * with hints for how it's going to be used. Readers map it read only and share
+ * it with each other, writers wait to have it to themselves
+ */
+unsigned char *open_image(char *image, int pattern, int access) {
+    int writable = access == EXT2_ACCESS_WRITE;
+    struct stat st;
+    int fd = open(image, writable ? O_RDWR : O_RDONLY);
+    if (fd < 0 || flock(fd, writable ? LOCK_EX : LOCK_SH) || fstat(fd, &st)) {
+        perror(image);
+        exit(1);
+    }
 
-        // Free indirect of indirect
-        while(block) {
-            set_block_bitmap(disk, *block, 0);
-            block++;
-        }
+    if ((size_t)st.st_size < 2 * EXT2_MIN_BLOCK_SIZE) {
+        fprintf(stderr, "%s: too small to be an ext2 image\n", image);
+        exit(1);
     }
 
-    EXT2_SET_BLOCKS(file, 0);
-}
+    // Whatever a crash left in the journal goes in first, or over the top for readers
+    struct stat jst;
+    journal_path = malloc(strlen(image) + sizeof(".journal"));
+    assert(journal_path);
+    strcpy(journal_path, image);
+    strcat(journal_path, ".journal");
+
+    int res = writable ? journal_replay(fd) : 0;
+    int overlay = !writable && !stat(journal_path, &jst) && jst.st_size;
+    if (res) {
+        fprintf(stderr, "%s: %s\n", journal_path, strerror(res));
+        exit(1);
+    }
 
-int _last_file(struct ext2_dir_entry_2 *block, void *required) {
-    char *dir_name = get_name(block);
-    unsigned int actual = EXT2_DIR_SIZE(dir_name);
-    free(dir_name);
+    // Small images are cheaper to fault in all at once. Journaling keeps changes
+    // private until they're flushed, and populating would copy every page then
+    int private = (writable && image_journal) || overlay;
+    int prot = writable || overlay ? PROT_READ | PROT_WRITE : PROT_READ;
+    int flags = private ? MAP_PRIVATE : MAP_SHARED | (st.st_size <= EXT2_POPULATE_MAX ? MAP_POPULATE : 0);
+    unsigned char *disk = mmap(NULL, st.st_size, prot, flags, fd, 0);
+    if (disk == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    image_size = st.st_size;
 
-    if (block->rec_len - actual >= *(int *)required) {
-        return 0;
+    if (overlay) {
+        journal_overlay(disk, image_size);
+        mprotect(disk, image_size, PROT_READ);
     }
-    return 1;
+
+    struct ext2_super_block *sb = EXT2_SUPER_BLOCK(disk);
+    if (sb->s_magic != EXT2_SUPER_MAGIC) {
+        fprintf(stderr, "%s: not an ext2 image\n", image);
+        exit(1);
+    }
+    if (sb->s_log_block_size > 2 || set_block_size(EXT2_MIN_BLOCK_SIZE << sb->s_log_block_size)) {
+        fprintf(stderr, "%s: unsupported block size\n", image);
+        exit(1);
+    }
+    if ((uint64_t)sb->s_blocks_count * EXT2_BLOCK_SIZE > image_size) {
+        fprintf(stderr, "%s: truncated image\n", image);
+        exit(1);
+    }
+
+    // The lock goes with the descriptor, so it stays open
+    image_fd = fd;
+    if (writable && image_journal) {
+        journal_fd = open(journal_path, O_RDWR | O_CREAT, 0644);
+        if (journal_fd < 0) {
+            perror(journal_path);
+            exit(1);
+        }
+        dirty_init(sb->s_blocks_count);
+    } else if (writable && image_sync == EXT2_SYNC_RANGE) {
+        dirty_init(sb->s_blocks_count);
+    }
+
+    // Hints are only hints, so failures are fine
+    if (image_size >= EXT2_HUGEPAGE_MIN) {
+        madvise(disk, image_size, MADV_HUGEPAGE);
+    }
+    if (pattern == EXT2_MAP_SEQUENTIAL) {
+        madvise(disk, image_size, MADV_SEQUENTIAL);
+    } else if (image_size > EXT2_POPULATE_MAX) {
+        madvise(disk, image_size, MADV_RANDOM);
+    }
+
+    // Superblock, descriptors, and each group's bitmaps and inode table get used either way
+    if (image_size > EXT2_POPULATE_MAX) {
+        unsigned int groups = EXT2_GROUP_COUNT(disk), group;
+        unsigned char *desc = (unsigned char *)EXT2_GROUP_DESC(disk);
+        size_t page = sysconf(_SC_PAGESIZE);
+
+        madvise(disk, desc + groups * sizeof(struct ext2_group_desc) - disk, MADV_WILLNEED);
+        for (group = 0; group < groups; group++) {
+            struct ext2_group_desc *gd = (struct ext2_group_desc *)desc + group;
+            unsigned char *table = EXT2_BLOCK(disk, gd->bg_inode_table);
+            unsigned char *start = EXT2_BLOCK(disk, MIN(gd->bg_block_bitmap, gd->bg_inode_bitmap));
+            start -= (uintptr_t)start % page;
+            madvise(start, MIN(table + (size_t)sb->s_inodes_per_group * EXT2_INODE_SIZE(disk), disk + image_size) - start, MADV_WILLNEED);
+        }
+    }
+
+    if (!image_disk) atexit(ext2_close);
+    image_disk = disk;
+    return disk;
 }
 
 /*
- * Adds a thing to the directory
+ * Read image from image file
  */
-struct ext2_dir_entry_2 *add_thing(unsigned char *disk, struct ext2_dir_entry_2 *dir, char *name, unsigned int type) {
-    // Create new file entry struct
-    struct ext2_dir_entry_2 *new_entry = (struct ext2_dir_entry_2 *)malloc(EXT2_DIR_SIZE(name));
-    int required = EXT2_DIR_SIZE(name);
+unsigned char *read_image(char *image, int access) {
+    return open_image(image, EXT2_MAP_METADATA, access);
+}
 
-    // Set the fields and bitmap
-    strncpy(new_entry->name, name, strlen(name));
-    new_entry->inode = get_free_inode(disk);
-    new_entry->name_len = strlen(name);
-    new_entry->file_type = type;
+char *get_name(struct ext2_dir_entry_2 *entry) {
+    char *name = (char *)malloc(entry->name_len + 1);
+    strncpy(name, entry->name, entry->name_len);
+    name[entry->name_len] = '\0';
+    return name;
+}
 
-    // Find last file in directory
-    struct ext2_dir_entry_2 *last_entry = iterate_inode(disk, get_inode(disk, dir->inode), _last_file, &required);
-    if (last_entry) {
-        char *dir_name = get_name(last_entry);
-        unsigned int actual = EXT2_DIR_SIZE(dir_name);
-        free(dir_name);
+char *get_dir(char *path) {
+	char *_path = (char *)malloc(strlen(path) + 1);
+	strncpy(_path, path, strlen(path) + 1);
 
-        new_entry->rec_len = last_entry->rec_len - actual;
-        memcpy((char *)last_entry + actual, new_entry, required);
-        last_entry->rec_len = actual;
+	char *token = strtok(_path, "/");
+	char *_token = NULL;
+	int i = 1;
 
-        // Return new file
-        free(new_entry);
-        return EXT2_NEXT_FILE(last_entry);
-    } else {
-        new_entry->rec_len = EXT2_BLOCK_SIZE;
-        struct ext2_inode *dir_inode = get_inode(disk, dir->inode);
-        int index = EXT2_NUM_BLOCKS(disk, dir_inode);
-
-        // Setup new block with entry to put into directory
-        int block_index = get_free_block(disk);
-        unsigned char *block = EXT2_BLOCK(disk, block_index);
-        memcpy(block, new_entry, required);
-
-        // Add direct block
-        if (index < EXT2_DIRECT_BLOCKS) {
-            EXT2_SET_BLOCKS(dir_inode, index + 1);
-            dir_inode->i_block[index] = block_index;
-
-        // New indirect block
-        } else if (index == EXT2_DIRECT_BLOCKS) {
-            // Make indirect block
-            int indirect = get_free_block(disk);
-            set_block_bitmap(disk, indirect, 1);
-            unsigned char *indirect_block = EXT2_BLOCK(disk, indirect);
-            memset(indirect_block, '\0', EXT2_BLOCK_SIZE);
-
-            // Add indirect block and entry to directory
-            EXT2_SET_BLOCKS(dir_inode, EXT2_DIRECT_BLOCKS + 1);
-            dir_inode->i_block[index] = indirect;
-            indirect_block[0] = block_index;
-
-        // Add new block to indirect block
-        } else {
-            // Find free spot
-            unsigned char *indirect_block = EXT2_BLOCK(disk, dir_inode->i_block[EXT2_DIRECT_BLOCKS]);
-            int i = 0;
-            while(indirect_block[i] && i < EXT2_BLOCK_SIZE/sizeof(int)) {
-                i++;
-            }
-            if (i >= EXT2_BLOCK_SIZE) {
-                fprintf(stderr, "No space in directory\n");
-                exit(ENOSPC);
-            }
+	do {
+		_token = strtok(NULL, "/");
+		if (_token) {
+			i += strlen(token) + 1;
+			token = _token;
+		}
+	} while (_token);
 
-            // Add new block to indirect
-            indirect_block[i] = block_index;
-        }
+	strncpy(_path, path, i);
+	_path[i - 1] = '\0';
 
-        free(new_entry);
-        return (struct ext2_dir_entry_2 *)block;
-    }
+	return _path;
 }
 
-/*
- * Given an absolute path, navigate to the block entry
- */
-struct ext2_dir_entry_2 *navigate(unsigned char *disk, char *path) {
-    struct ext2_inode *inode = get_inode(disk, EXT2_ROOT_INO); // Root directory
-    struct ext2_dir_entry_2 *entry = find_file(disk, inode, ".");
-    
+char *get_filename(char *path) {
     char *_path = (char *)malloc(strlen(path) + 1);
     strncpy(_path, path, strlen(path) + 1);
-    char *token = strtok(_path, "/");
+	char *token = strtok(_path, "/");
+	char *_token;
 
-    while(token) {
-        entry = find_file(disk, inode, token);
-        token = strtok(NULL, "/");
-        // If subdirectory is a file, return NULL. Else return the last file
-        if (!EXT2_IS_DIRECTORY(entry)) {
-            free(_path);
-            return token ? NULL : entry;
-        }
-        inode = get_inode(disk, entry->inode);
-    }
-    
-    // Return the file/directory
-    free(_path);
-    return entry;
+	do {
+		_token = strtok(NULL, "/");
+		if (_token) token = _token;
+	} while (_token);
+
+    memmove(_path, token, strlen(token) + 1);
+	return _path;
 }
 
 /*
- * Removes the content and inode of a file
+ * Descriptor of a block group
  */
-void remove_file(unsigned char *disk, struct ext2_dir_entry_2 *file) {
-    // Free inode
-    struct ext2_inode *inode = get_inode(disk, file->inode);
-    set_inode_bitmap(disk, file->inode, 0);
-    inode->i_dtime = time(0);
-    inode->i_size = 0;
-
-    // Free blocks
-    free_blocks(disk, file->inode);
+struct ext2_group_desc *get_group_desc(unsigned char *disk, unsigned int group) {
+    return EXT2_GROUP_DESC(disk) + group;
 }
 
-int _remove_dir(struct ext2_dir_entry_2 *block, void *_disk) {
-    unsigned char *disk = (unsigned char *)_disk;
-    char *name = get_name(block);
-
-    // If are . and .., then ignore them
-    if (!strcmp(name, ".") || !strcmp(name, "..")) {
-        free(name);
-        return 1;
-    } else if (EXT2_IS_DIRECTORY(block)) {
-        remove_dir(disk, block);
-    } else {
-        remove_file(disk, block);
-    }
-
-    free(name);
-    return 1;
+/*
+ * Given inode number, get inode
+ */
+struct ext2_inode *get_inode(unsigned char *disk, unsigned int number) {
+    unsigned int per_group = EXT2_SUPER_BLOCK(disk)->s_inodes_per_group;
+    struct ext2_group_desc *desc = get_group_desc(disk, (number - 1) / per_group);
+    unsigned char *table = EXT2_BLOCK(disk, desc->bg_inode_table);
+    return (struct ext2_inode *)(table + (size_t)((number - 1) % per_group) * EXT2_INODE_SIZE(disk));
 }
+
 /*
- * Removes the files/directories of a directory and it's inode
+ * Group an inode is in
  */
-void remove_dir(unsigned char *disk, struct ext2_dir_entry_2 *dir) {
-    // Free inode
-    struct ext2_inode *inode = get_inode(disk, dir->inode);
-    set_inode_bitmap(disk, dir->inode, 0);
-    inode->i_dtime = time(0);
-    inode->i_size = 0;
+unsigned int inode_group(unsigned char *disk, unsigned int number) {
+    return (number - 1) / EXT2_SUPER_BLOCK(disk)->s_inodes_per_group;
+}
 
-    // Remove contents before the actual blocks
-    iterate_inode(disk, inode, _remove_dir, disk);
-    free_blocks(disk, dir->inode);
+/*
+ * Group a block is in
+ */
+unsigned int block_group(unsigned char *disk, unsigned int block) {
+    struct ext2_super_block *sb = EXT2_SUPER_BLOCK(disk);
+    return (block - sb->s_first_data_block) / sb->s_blocks_per_group;
 }
 
 /*
- * Removes an entry from a directory
+ * Group to put an inode's blocks in, the one holding its inode table. Without
+ * flex_bg, which ext2 doesn't have, that's the group the inode is in
+ */
+unsigned int inode_block_group(unsigned char *disk, struct ext2_inode *inode) {
+    return block_group(disk, ((unsigned char *)inode - disk) / EXT2_BLOCK_SIZE);
+}
+
+/*
+ * Blocks in a group, the last one is usually short
+ */
+unsigned int group_blocks(unsigned char *disk, unsigned int group) {
+    struct ext2_super_block *sb = EXT2_SUPER_BLOCK(disk);
+    unsigned int first = sb->s_first_data_block + group * sb->s_blocks_per_group;
+    return MIN(sb->s_blocks_per_group, sb->s_blocks_count - first);
+}
+
+/*
+ * Does a group have a copy of the superblock and descriptors. With sparse_super
+ * only groups 0, 1 and powers of 3, 5 and 7 do
+ */
+int group_has_super(unsigned char *disk, unsigned int group) {
+    unsigned int base[] = { 3, 5, 7 }, i, power;
+    if (group <= 1 || !(EXT2_SUPER_BLOCK(disk)->s_feature_ro_compat & EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER)) return 1;
+
+    for (i = 0; i < 3; i++) {
+        for (power = base[i]; power < group; power *= base[i]);
+        if (power == group) return 1;
+    }
+    return 0;
+}
+
+/*
+ * Blocks at the start of a group its superblock and descriptor copies take,
+ * reserved descriptor blocks included. 0 if it doesn't have them
+ */
+unsigned int group_super_blocks(unsigned char *disk, unsigned int group) {
+    struct ext2_super_block *sb = EXT2_SUPER_BLOCK(disk);
+    size_t desc_size = (size_t)EXT2_GROUP_COUNT(disk) * sizeof(struct ext2_group_desc);
+    if (!group_has_super(disk, group)) return 0;
+    return 1 + (desc_size + EXT2_BLOCK_SIZE - 1) / EXT2_BLOCK_SIZE + EXT2_RESERVED_GDT_BLOCKS(sb);
+}
+
+/*
+ * Bits set in the first bits of a bitmap
+ */
+unsigned int bitmap_used(unsigned char *map, unsigned int bits) {
+    unsigned int used = 0, i = 0;
+    uint64_t word;
+
+    for (; i + 64 <= bits; i += 64) {
+        memcpy(&word, map + i / 8, sizeof(word));
+        used += __builtin_popcountll(word);
+    }
+    for (; i < bits; i++) {
+        used += (map[i / 8] >> (i % 8)) & 1;
+    }
+    return used;
+}
+
+/*
+ * Allocation state of a bitmap. Kept for the life of the process so that
+ * allocations carry on from where the last one ended (next-fit), and a
+ * summary with one bit per 64 bit word of the map, set when that word is
+ * full, lets scans skip over allocated regions.
+ */
+struct ext2_bitmap {
+    unsigned char *map;    // Bitmap this state was built for
+    unsigned int limit;    // Number of bits in the map
+    unsigned int start;    // First bit that can be handed out
+    unsigned int cursor;   // Where the last allocation ended
+    unsigned int words;    // Number of 64 bit words in the map
+    uint64_t *summary;     // Bit set when the word is full
+};
+
+// One of each per group, see load_group_states
+struct ext2_bitmap *block_bitmap_states;
+struct ext2_bitmap *inode_bitmap_states;
+unsigned int bitmap_state_groups;
+
+/*
+ * Makes room for the allocation state of every group
+ */
+void load_group_states(unsigned char *disk) {
+    unsigned int groups = EXT2_GROUP_COUNT(disk);
+    if (bitmap_state_groups == groups) return;
+
+    free(block_bitmap_states);
+    free(inode_bitmap_states);
+    block_bitmap_states = calloc(groups, sizeof(struct ext2_bitmap));
+    inode_bitmap_states = calloc(groups, sizeof(struct ext2_bitmap));
+    assert(block_bitmap_states && inode_bitmap_states);
+    bitmap_state_groups = groups;
+}
+
+/*
+ * Gets a 64 bit word of the bitmap, bits past the limit read as used
+ */
+uint64_t bitmap_word(struct ext2_bitmap *bm, unsigned int w) {
+    uint64_t word = 0;
+    unsigned int bytes = MIN(8, (bm->limit + 7) / 8 - w * 8);
+    memcpy(&word, bm->map + w * 8, bytes);
+
+    if ((w + 1) * 64 > bm->limit) {
+        word |= ~0ULL << (bm->limit % 64);
+    }
+    return word;
+}
+
+/*
+ * Sets the summary bit of a word depending on if it's full
+ */
+void bitmap_summarize(struct ext2_bitmap *bm, unsigned int w) {
+    if (~bitmap_word(bm, w)) {
+        bm->summary[w / 64] &= ~(1ULL << w % 64);
+    } else {
+        bm->summary[w / 64] |= 1ULL << w % 64;
+    }
+}
+
+/*
+ * Gets the state of the bitmap, (re)building the summary if it's a new map
+ */
+struct ext2_bitmap *load_bitmap(struct ext2_bitmap *bm, unsigned char *map, unsigned int limit, unsigned int start) {
+    if (bm->map == map && bm->limit == limit) return bm;
+
+    unsigned int i, count;
+    free(bm->summary);
+    bm->map = map;
+    bm->limit = limit;
+    bm->start = start;
+    bm->cursor = start;
+    bm->words = (limit + 63) / 64;
+
+    // Words that don't exist are full, so scans never land on them
+    count = (bm->words + 63) / 64;
+    bm->summary = malloc(count * sizeof(uint64_t));
+    assert(bm->summary);
+    memset(bm->summary, 0xff, count * sizeof(uint64_t));
+
+    for (i = 0; i < bm->words; i++) {
+        bitmap_summarize(bm, i);
+    }
+    return bm;
+}
+
+/*
+ * Finds the next word at or after w that is not full, or words if none
+ */
+unsigned int bitmap_next_open(struct ext2_bitmap *bm, unsigned int w) {
+    unsigned int s = w / 64, count = (bm->words + 63) / 64;
+    if (s >= count) return bm->words;
+
+    // Summary bits of words before w count as full
+    uint64_t open = ~bm->summary[s] & (~0ULL << w % 64);
+    while (!open) {
+        if (++s >= count) return bm->words;
+        open = ~bm->summary[s];
+    }
+    return MIN(s * 64 + __builtin_ctzll(open), bm->words);
+}
+
+/*
+ * Searches the bitmap a word at a time for the first free bit in [from, to)
+ */
+int bitmap_scan(struct ext2_bitmap *bm, unsigned int from, unsigned int to) {
+    if (from >= to) return -1;
+
+    // Bits before from count as used
+    unsigned int w = from / 64;
+    uint64_t word = bitmap_word(bm, w) | ((1ULL << from % 64) - 1);
+
+    while (w * 64 < to) {
+        if (~word) {
+            unsigned int i = w * 64 + __builtin_ctzll(~word);
+            return i < to ? (int)i : -1;
+        }
+
+        w = bitmap_next_open(bm, w + 1);
+        if (w >= bm->words) break;
+        word = bitmap_word(bm, w);
+    }
+
+    return -1;
+}
+
+/*
+ * Searches the bitmap a word at a time for the first used bit in [from, to),
+ * returns to if there is none
+ */
+unsigned int bitmap_scan_used(struct ext2_bitmap *bm, unsigned int from, unsigned int to) {
+    unsigned int w = from / 64;
+    uint64_t word = bitmap_word(bm, w) & (~0ULL << from % 64);
+
+    while (w * 64 < to) {
+        if (word) return MIN(w * 64 + __builtin_ctzll(word), to);
+        if (++w >= bm->words) break;
+        word = bitmap_word(bm, w);
+    }
+    return to;
+}
+
+/*
+ * Searches [from, to) for a run of want free bits. Returns the first one long
+ * enough, or else the longest run, with its length in len
+ */
+int bitmap_scan_run(struct ext2_bitmap *bm, unsigned int from, unsigned int to, unsigned int want, unsigned int *len) {
+    int best = -1, i;
+    unsigned int end;
+    *len = 0;
+
+    while ((i = bitmap_scan(bm, from, to)) >= 0) {
+        end = bitmap_scan_used(bm, i, MIN(i + want, to));
+        if (end - i > *len) {
+            best = i;
+            *len = end - i;
+            if (*len >= want) break;
+        }
+        from = end;
+    }
+    return best;
+}
+
+/*
+ * Searches provided bitmap for a free bit, starting where the last allocation
+ * ended and wrapping around to the start
+ */
+int get_free_thing(struct ext2_bitmap *bm) {
+    int i = bitmap_scan(bm, MAX(bm->cursor, bm->start), bm->limit);
+    if (i < 0) {
+        i = bitmap_scan(bm, bm->start, MIN(bm->cursor, bm->limit));
+    }
+    return i;
+}
+
+/*
+ * Searches provided bitmap for a run of want free bits, next-fit like
+ * get_free_thing. If no run is long enough, gets the longest one
+ */
+int get_free_thing_run(struct ext2_bitmap *bm, unsigned int want, unsigned int *len) {
+    unsigned int _len;
+    int i = bitmap_scan_run(bm, MAX(bm->cursor, bm->start), bm->limit, want, len);
+    if (*len < want) {
+        int j = bitmap_scan_run(bm, bm->start, MIN(bm->cursor, bm->limit), want, &_len);
+        if (_len > *len) {
+            i = j;
+            *len = _len;
+        }
+    }
+    return i;
+}
+
+/*
+ * Sets a run of bits a 64 bit word at a time. Returns how many actually changed
+ */
+unsigned int set_thing_run(struct ext2_bitmap *bm, unsigned int index, unsigned int len, unsigned state) {
+    unsigned int w, end = index + len, changed = 0;
+    uint64_t word, mask;
+    if (!len) return 0;
+
+    for (w = index / 64; w <= (end - 1) / 64; w++) {
+        // Bits of this word inside [index, end)
+        mask = ~0ULL;
+        if (w == index / 64) mask &= ~0ULL << index % 64;
+        if (w == (end - 1) / 64 && end % 64) mask &= ~0ULL >> (64 - end % 64);
+
+        memcpy(&word, bm->map + w * 8, 8);
+        changed += __builtin_popcountll((state ? ~word : word) & mask);
+        word = state ? (word | mask) : (word & ~mask);
+        memcpy(bm->map + w * 8, &word, 8);
+        bitmap_summarize(bm, w);
+    }
+
+    if (state) {
+        // Next allocation carries on after this one
+        bm->cursor = end;
+    } else if (bm->cursor == end) {
+        // Handing back the last allocation, so reuse it
+        bm->cursor = index;
+    }
+    return changed;
+}
+
+/*
+ * What the current operation has done to the bitmaps. Allocations go into the
+ * bitmaps straight away so nothing else gets them, but frees wait until commit,
+ * so nothing freed is handed out again before the operation is done. Free counts
+ * are kept here and only written to the group descriptors and superblock then.
+ */
+struct ext2_release {
+    unsigned int first;     // Block or inode number
+    unsigned int len;
+    unsigned int inode;     // Inodes, else blocks
+};
+
+struct ext2_alloc_ctx {
+    unsigned int groups;
+    int *free_blocks;               // Change to each group's free blocks
+    int *free_inodes;               // and free inodes
+    struct ext2_release *frees;     // Waiting for commit
+    size_t count;
+    size_t size;
+};
+
+struct ext2_alloc_ctx alloc_ctx;
+
+/*
+ * Makes room for the counters of every group
+ */
+struct ext2_alloc_ctx *get_alloc_ctx(unsigned char *disk) {
+    unsigned int groups = EXT2_GROUP_COUNT(disk);
+    if (alloc_ctx.groups != groups) {
+        free(alloc_ctx.free_blocks);
+        free(alloc_ctx.free_inodes);
+        alloc_ctx.free_blocks = calloc(groups, sizeof(int));
+        alloc_ctx.free_inodes = calloc(groups, sizeof(int));
+        assert(alloc_ctx.free_blocks && alloc_ctx.free_inodes);
+        alloc_ctx.groups = groups;
+    }
+    return &alloc_ctx;
+}
+
+/*
+ * Remembers a run of blocks or inodes to free at commit
+ */
+void alloc_defer_free(unsigned char *disk, unsigned int first, unsigned int len, unsigned int inode) {
+    struct ext2_alloc_ctx *ctx = get_alloc_ctx(disk);
+
+    // Carry on from the last one if it's right after it
+    if (ctx->count) {
+        struct ext2_release *last = &ctx->frees[ctx->count - 1];
+        if (last->inode == inode && last->first + last->len == first) {
+            last->len += len;
+            return;
+        }
+    }
+
+    if (ctx->count == ctx->size) {
+        ctx->size = ctx->size ? ctx->size * 2 : 256;
+        ctx->frees = realloc(ctx->frees, ctx->size * sizeof(struct ext2_release));
+        assert(ctx->frees);
+    }
+    ctx->frees[ctx->count].first = first;
+    ctx->frees[ctx->count].len = len;
+    ctx->frees[ctx->count].inode = inode;
+    ctx->count++;
+}
+
+/*
+ * Gets the allocation state for the block bitmap of a group, bit i is block
+ * i + s_first_data_block + group * s_blocks_per_group
+ */
+struct ext2_bitmap *get_block_bitmap(unsigned char *disk, unsigned int group) {
+    struct ext2_group_desc *desc = get_group_desc(disk, group);
+    struct ext2_super_block *sb = EXT2_SUPER_BLOCK(disk);
+    unsigned int first = sb->s_first_data_block + group * sb->s_blocks_per_group;
+    unsigned int limit = MIN(sb->s_blocks_count - first, sb->s_blocks_per_group);
+
+    load_group_states(disk);
+    return load_bitmap(&block_bitmap_states[group], EXT2_BLOCK(disk, desc->bg_block_bitmap), limit, 0);
+}
+
+/*
+ * Gets the allocation state for the inode bitmap of a group, bit i is inode
+ * i + 1 + group * s_inodes_per_group. Reserved inodes are never handed out
+ */
+struct ext2_bitmap *get_inode_bitmap(unsigned char *disk, unsigned int group) {
+    struct ext2_group_desc *desc = get_group_desc(disk, group);
+    struct ext2_super_block *sb = EXT2_SUPER_BLOCK(disk);
+    unsigned int first = EXT2_FIRST_INO(disk) - 1;
+    unsigned int start = group * sb->s_inodes_per_group < first ? first - group * sb->s_inodes_per_group : 0;
+
+    load_group_states(disk);
+    return load_bitmap(&inode_bitmap_states[group], EXT2_BLOCK(disk, desc->bg_inode_bitmap), sb->s_inodes_per_group, start);
+}
+
+/*
+ * Sets bits for a run of len blocks starting at index, a group at a time.
+ * Frees wait for commit
+ */
+int set_block_run(unsigned char *disk, unsigned int index, unsigned int len, unsigned state) {
+    struct ext2_super_block *sb = EXT2_SUPER_BLOCK(disk);
+    struct ext2_alloc_ctx *ctx = get_alloc_ctx(disk);
+
+    // Block 0 is never mapped, it means no block
+    if (index < sb->s_first_data_block || index >= sb->s_blocks_count) return 0;
+    len = MIN(len, sb->s_blocks_count - index);
+
+    if (!state) {
+        alloc_defer_free(disk, index, len, 0);
+        return 0;
+    }
+
+    while (len) {
+        unsigned int group = block_group(disk, index);
+        unsigned int bit = (index - sb->s_first_data_block) % sb->s_blocks_per_group;
+        unsigned int count = MIN(len, sb->s_blocks_per_group - bit);
+        struct ext2_bitmap *bm = get_block_bitmap(disk, group);
+
+        ctx->free_blocks[group] -= set_thing_run(bm, bit, count, 1);
+        mark_dirty(disk, bm->map + bit / 8, (bit % 8 + count + 7) / 8);
+        index += count;
+        len -= count;
+    }
+    return 0;
+}
+
+/*
+ * Sets bit for block bitmap
+ */
+int set_block_bitmap(unsigned char *disk, unsigned int index, unsigned state) {
+    return set_block_run(disk, index, 1, state);
+}
+
+/*
+ * Sets bit for inode bitmap. Frees wait for commit
+ */
+int set_inode_bitmap(unsigned char *disk, unsigned int index, unsigned state) {
+    struct ext2_super_block *sb = EXT2_SUPER_BLOCK(disk);
+    struct ext2_alloc_ctx *ctx = get_alloc_ctx(disk);
+    if (!index || index > sb->s_inodes_count) return 0;
+
+    if (!state) {
+        alloc_defer_free(disk, index, 1, 1);
+        return 0;
+    }
+
+    unsigned int group = inode_group(disk, index), bit = (index - 1) % sb->s_inodes_per_group;
+    struct ext2_bitmap *bm = get_inode_bitmap(disk, group);
+    ctx->free_inodes[group] -= set_thing_run(bm, bit, 1, 1);
+    mark_dirty(disk, bm->map + bit / 8, 1);
+    return 0;
+}
+
+int release_cmp(const void *a, const void *b) {
+    const struct ext2_release *x = a, *y = b;
+    if (x->inode != y->inode) return x->inode < y->inode ? -1 : 1;
+    return x->first < y->first ? -1 : x->first > y->first;
+}
+
+/*
+ * Ends the allocation context of an operation: applies the frees in order,
+ * and writes the free counts once
+ */
+void alloc_commit(unsigned char *disk) {
+    struct ext2_super_block *sb = EXT2_SUPER_BLOCK(disk);
+    struct ext2_alloc_ctx *ctx = get_alloc_ctx(disk);
+    struct ext2_bitmap *bm;
+    unsigned int group, bit, count;
+    int blocks = 0, inodes = 0;
+    size_t i;
+
+    qsort(ctx->frees, ctx->count, sizeof(struct ext2_release), release_cmp);
+    for (i = 0; i < ctx->count; i++) {
+        struct ext2_release *r = &ctx->frees[i];
+        while (r->len) {
+            if (r->inode) {
+                group = inode_group(disk, r->first);
+                bit = (r->first - 1) % sb->s_inodes_per_group;
+                count = MIN(r->len, sb->s_inodes_per_group - bit);
+                bm = get_inode_bitmap(disk, group);
+                ctx->free_inodes[group] += set_thing_run(bm, bit, count, 0);
+            } else {
+                group = block_group(disk, r->first);
+                bit = (r->first - sb->s_first_data_block) % sb->s_blocks_per_group;
+                count = MIN(r->len, sb->s_blocks_per_group - bit);
+                bm = get_block_bitmap(disk, group);
+                ctx->free_blocks[group] += set_thing_run(bm, bit, count, 0);
+                mark_freed(disk, r->first, count);
+            }
+            mark_dirty(disk, bm->map + bit / 8, (bit % 8 + count + 7) / 8);
+            r->first += count;
+            r->len -= count;
+        }
+    }
+    ctx->count = 0;
+
+    for (group = 0; group < ctx->groups; group++) {
+        struct ext2_group_desc *desc = get_group_desc(disk, group);
+        if (!ctx->free_blocks[group] && !ctx->free_inodes[group]) continue;
+
+        mark_dirty(disk, desc, sizeof(struct ext2_group_desc));
+        desc->bg_free_blocks_count += ctx->free_blocks[group];
+        desc->bg_free_inodes_count += ctx->free_inodes[group];
+        blocks += ctx->free_blocks[group];
+        inodes += ctx->free_inodes[group];
+        ctx->free_blocks[group] = 0;
+        ctx->free_inodes[group] = 0;
+    }
+    if (blocks || inodes) {
+        mark_dirty(disk, sb, sizeof(struct ext2_super_block));
+        sb->s_free_blocks_count += blocks;
+        sb->s_free_inodes_count += inodes;
+    }
+}
+
+/*
+ * Get the next free block, from group goal if it has any, else the groups after it
+ */
+int get_free_block(unsigned char *disk, unsigned int goal) {
+    struct ext2_super_block *sb = EXT2_SUPER_BLOCK(disk);
+    unsigned int groups = EXT2_GROUP_COUNT(disk), i, group;
+    int bit;
+
+    for (i = 0; i < groups; i++) {
+        group = (goal + i) % groups;
+        bit = get_free_thing(get_block_bitmap(disk, group));
+        if (bit >= 0) return bit + sb->s_first_data_block + group * sb->s_blocks_per_group;
+    }
+    return -1;
+}
+
+/*
+ * Get a run of up to want free blocks, next-fit in group goal. Goes to the
+ * groups after it only when goal has no run that long, and then takes the first
+ * long enough or else the longest found. Sets len to its length
+ */
+int get_free_run(unsigned char *disk, unsigned int goal, unsigned int want, unsigned int *len) {
+    struct ext2_super_block *sb = EXT2_SUPER_BLOCK(disk);
+    unsigned int groups = EXT2_GROUP_COUNT(disk), i, group, _len;
+    int best = -1, bit;
+    *len = 0;
+
+    for (i = 0; i < groups && *len < want; i++) {
+        group = (goal + i) % groups;
+        bit = get_free_thing_run(get_block_bitmap(disk, group), want, &_len);
+        if (bit >= 0 && _len > *len) {
+            best = bit + sb->s_first_data_block + group * sb->s_blocks_per_group;
+            *len = _len;
+        }
+    }
+    return best;
+}
+
+/*
+ * Picks the group for a new inode whose directory is inode parent. Files go
+ * with their directory. Directories stay with their parent too while its group
+ * has at least the average free inodes and blocks, but those under the root, or
+ * when the parent's group is getting full, are spread out to the group with
+ * the fewest directories of those that do (like Orlov in Linux)
+ */
+unsigned int find_inode_group(unsigned char *disk, unsigned int parent, int is_dir) {
+    struct ext2_super_block *sb = EXT2_SUPER_BLOCK(disk);
+    unsigned int groups = EXT2_GROUP_COUNT(disk), i, group;
+    unsigned int home = inode_group(disk, parent);
+    struct ext2_group_desc *desc = get_group_desc(disk, home);
+    unsigned int avg_inodes = sb->s_free_inodes_count / groups;
+    unsigned int avg_blocks = sb->s_free_blocks_count / groups;
+    int best = -1;
+
+    if (!is_dir || groups == 1) return home;
+    if (parent != EXT2_ROOT_INO && desc->bg_free_inodes_count >= avg_inodes && desc->bg_free_blocks_count >= avg_blocks) {
+        return home;
+    }
+
+    for (i = 0; i < groups; i++) {
+        group = (home + i) % groups;
+        desc = get_group_desc(disk, group);
+        if (!desc->bg_free_inodes_count || desc->bg_free_inodes_count < avg_inodes || desc->bg_free_blocks_count < avg_blocks) {
+            continue;
+        }
+        if (best < 0 || desc->bg_used_dirs_count < get_group_desc(disk, best)->bg_used_dirs_count) {
+            best = group;
+        }
+    }
+    return best < 0 ? home : (unsigned int)best;
+}
+
+/*
+ * Get the next free inode, from group goal if it has any, else the groups after it
+ */
+int get_free_inode(unsigned char *disk, unsigned int goal) {
+    struct ext2_super_block *sb = EXT2_SUPER_BLOCK(disk);
+    unsigned int groups = EXT2_GROUP_COUNT(disk), i, group;
+    int bit;
+
+    for (i = 0; i < groups; i++) {
+        group = (goal + i) % groups;
+        bit = get_free_thing(get_inode_bitmap(disk, group));
+        if (bit >= 0) return bit + 1 + group * sb->s_inodes_per_group;
+    }
+    return -1;
+}
+
+struct ext2_name entry_name(struct ext2_dir_entry_2 *entry) {
+    struct ext2_name name = { entry->name, entry->name_len };
+    return name;
+}
+
+struct ext2_name str_name(const char *str) {
+    struct ext2_name name = { str, strlen(str) };
+    return name;
+}
+
+int name_eq(struct ext2_name a, struct ext2_name b) {
+    return a.len == b.len && !memcmp(a.ptr, b.ptr, a.len);
+}
+
+int name_cmp(struct ext2_name a, struct ext2_name b) {
+    int res = memcmp(a.ptr, b.ptr, MIN(a.len, b.len));
+    return res ? res : (int)a.len - (int)b.len;
+}
+
+/*
+ * Is it . or ..
+ */
+int name_is_dots(struct ext2_name name) {
+    return (name.len == 1 || name.len == 2) && name.ptr[0] == '.' && name.ptr[name.len - 1] == '.';
+}
+
+/*
+ * Finds the table of block numbers holding logical block n of an inode, either
+ * i_block itself or an indirect block, and sets first to the logical block of its
+ * first slot and len to its number of slots. When an indirect block on the way is
+ * missing it's made if alloc is set, else returns NULL with first and len covering
+ * everything the missing block would map. len is 0 if n can't be mapped at all.
+ * bs is the block size, always a constant, see EXT2_BLOCK_VARIANTS.
+ */
+static inline __attribute__((always_inline))
+unsigned int *block_table_for(unsigned char *disk, struct ext2_inode *inode, unsigned int n, int alloc, unsigned int *first, unsigned int *len, const unsigned int bs) {
+    // Block numbers in a block are a power of two, so it's all shifts and masks
+    const unsigned int bits = bs == 1024 ? 8 : bs == 2048 ? 9 : 10;
+    const unsigned int per = 1U << bits;
+    unsigned int depth = 1, *slot, *table;
+    uint64_t rel = n;
+
+    if (n < EXT2_DIRECT_BLOCKS) {
+        *first = 0;
+        *len = EXT2_DIRECT_BLOCKS;
+        return inode->i_block;
+    }
+
+    // Single, double or triple indirect, each maps 1 << bits * depth blocks
+    rel -= EXT2_DIRECT_BLOCKS;
+    while (rel >> bits * depth) {
+        rel -= (uint64_t)1 << bits * depth;
+        if (++depth > 3) {
+            *first = n;
+            *len = 0;
+            return NULL;
+        }
+    }
+
+    // Down the indirect blocks, slot always maps 1 << bits * depth blocks
+    slot = &inode->i_block[EXT2_DIRECT_BLOCKS + depth - 1];
+    while (1) {
+        if (!*slot) {
+            if (!alloc) {
+                *first = n - (rel & ((1ULL << bits * depth) - 1));
+                *len = 1U << bits * depth;
+                return NULL;
+            }
+
+            int block = get_free_block(disk, inode_block_group(disk, inode));
+            if (block < 0) {
+                fprintf(stderr, "No space left on disk\n");
+                exit(ENOSPC);
+            }
+            set_block_bitmap(disk, block, 1);
+            memset(disk + (size_t)bs * block, '\0', bs);
+            EXT2_SET_BLOCKS(inode, EXT2_NUM_BLOCKS(disk, inode) + 1);
+            *slot = block;
+            mark_dirty(disk, disk + (size_t)bs * block, bs);
+            mark_dirty(disk, slot, sizeof(*slot));
+            mark_inode(disk, inode);
+        }
+
+        table = (unsigned int *)(disk + (size_t)bs * *slot);
+        if (!--depth) {
+            *first = n - (rel & (per - 1));
+            *len = per;
+            return table;
+        }
+        slot = &table[(rel >> bits * depth) & (per - 1)];
+    }
+}
+
+/*
+ * Streams through the block map of an inode a run of physically consecutive
+ * blocks at a time. Only the table of block numbers it's in is kept, so any
+ * size of file takes the same memory to walk.
+ */
+struct ext2_block_walk {
+    unsigned char *disk;
+    struct ext2_inode *inode;
+    unsigned int logical;       // Next logical block
+    unsigned int limit;         // Stop before this logical block
+    unsigned int *table;        // Block numbers around logical, NULL in a hole
+    unsigned int first;         // Logical block of table[0], or of the hole
+    unsigned int len;           // Slots in table, or blocks in the hole
+};
+
+/*
+ * Starts a walk at logical block from, up to the end of the file. A fast
+ * symlink has nothing to walk, its i_block is the target
+ */
+void block_walk_init(struct ext2_block_walk *walk, unsigned char *disk, struct ext2_inode *inode, unsigned int from) {
+    walk->disk = disk;
+    walk->inode = inode;
+    walk->logical = from;
+    walk->limit = EXT2_IS_FAST_LINK(inode) ? 0 : (inode->i_size + EXT2_BLOCK_SIZE - 1) / EXT2_BLOCK_SIZE;
+    walk->table = NULL;
+    walk->first = 0;
+    walk->len = 0;
+}
+
+/*
+ * Gets the next run, its first logical and physical block and its length. Holes
+ * come back as runs of block 0. Returns 0 at the end
+ */
+static inline __attribute__((always_inline))
+int block_walk_next_for(struct ext2_block_walk *walk, unsigned int *logical, unsigned int *physical, unsigned int *len, const unsigned int bs) {
+    unsigned int block;
+    *logical = walk->logical;
+    *physical = 0;
+    *len = 0;
+
+    while (walk->logical < walk->limit) {
+        if (walk->logical < walk->first || walk->logical - walk->first >= walk->len) {
+            walk->table = block_table_for(walk->disk, walk->inode, walk->logical, 0, &walk->first, &walk->len, bs);
+
+            // Past what can be mapped
+            if (!walk->len) {
+                walk->limit = walk->logical;
+                break;
+            }
+        }
+
+        // A whole missing indirect block is one hole
+        if (!walk->table) {
+            if (*len && *physical) break;
+            block = MIN(walk->first + walk->len, walk->limit) - walk->logical;
+            *len += block;
+            walk->logical += block;
+            continue;
+        }
+
+        block = walk->table[walk->logical - walk->first];
+        if (*len && block != (*physical ? *physical + *len : 0)) break;
+        if (!*len) *physical = block;
+        (*len)++;
+        walk->logical++;
+    }
+
+    return *len > 0;
+}
+
+/*
+ * Cursor over the entries of a directory, walking its blocks in place so going
+ * through one allocates nothing. Unused entries are returned too, check inode.
+ */
+struct ext2_dir_iter {
+    unsigned char *disk;
+    struct ext2_inode *inode;   // Directory, NULL when only going over one block
+    struct ext2_block_walk walk; // Where its blocks are
+    unsigned int physical;      // Next block of the current run
+    unsigned int left;          // Blocks left in the run
+    unsigned char *data;        // Block being looked at, NULL if none
+    unsigned int offset;        // Where the next entry is in the block
+};
+
+void dir_iter_init(struct ext2_dir_iter *it, unsigned char *disk, struct ext2_inode *inode) {
+    it->disk = disk;
+    it->inode = inode;
+    block_walk_init(&it->walk, disk, inode, 0);
+    it->left = 0;
+    it->data = NULL;
+    it->offset = 0;
+}
+
+/*
+ * Cursor over the entries of a single directory block
+ */
+void dir_iter_block(struct ext2_dir_iter *it, unsigned char *block) {
+    it->disk = NULL;
+    it->inode = NULL;
+    it->left = 0;
+    it->data = block;
+    it->offset = 0;
+}
+
+/*
+ * Gets the next entry, or NULL when there are no more
+ */
+static inline __attribute__((always_inline))
+struct ext2_dir_entry_2 *dir_iter_next_for(struct ext2_dir_iter *it, const unsigned int bs) {
+    struct ext2_dir_entry_2 *entry;
+    unsigned int logical;
+
+    while (1) {
+        // Stop at the end of the block, or at anything that doesn't fit in it
+        if (it->data && it->offset + sizeof(struct ext2_dir_entry_2) <= bs) {
+            entry = (struct ext2_dir_entry_2 *)(it->data + it->offset);
+            if (entry->rec_len >= sizeof(struct ext2_dir_entry_2) && it->offset + entry->rec_len <= bs) {
+                it->offset += entry->rec_len;
+                return entry;
+            }
+        }
+
+        // Next block of the run, or the next run. Holes have no entries
+        it->data = NULL;
+        it->offset = 0;
+        if (!it->left && (!it->inode || !block_walk_next_for(&it->walk, &logical, &it->physical, &it->left, bs))) {
+            return NULL;
+        }
+        if (it->physical) it->data = it->disk + (size_t)bs * it->physical++;
+        it->left--;
+    }
+}
+
+/*
+ * The hot loops over block maps and directories, built once for each block size
+ * so the size is a constant in them. set_block_size picks which ones get used.
+ */
+#define EXT2_BLOCK_VARIANTS(bs) \
+    unsigned int *get_block_table_##bs(unsigned char *disk, struct ext2_inode *inode, unsigned int n, int alloc, unsigned int *first, unsigned int *len) { \
+        return block_table_for(disk, inode, n, alloc, first, len, bs); \
+    } \
+    int block_walk_next_##bs(struct ext2_block_walk *walk, unsigned int *logical, unsigned int *physical, unsigned int *len) { \
+        return block_walk_next_for(walk, logical, physical, len, bs); \
+    } \
+    struct ext2_dir_entry_2 *dir_iter_next_##bs(struct ext2_dir_iter *it) { \
+        return dir_iter_next_for(it, bs); \
+    }
+
+EXT2_BLOCK_VARIANTS(1024)
+EXT2_BLOCK_VARIANTS(2048)
+EXT2_BLOCK_VARIANTS(4096)
+
+struct ext2_block_ops {
+    unsigned int *(*block_table)(unsigned char *, struct ext2_inode *, unsigned int, int, unsigned int *, unsigned int *);
+    int (*walk_next)(struct ext2_block_walk *, unsigned int *, unsigned int *, unsigned int *);
+    struct ext2_dir_entry_2 *(*dir_next)(struct ext2_dir_iter *);
+};
+
+struct ext2_block_ops block_ops = { get_block_table_1024, block_walk_next_1024, dir_iter_next_1024 };
+
+/*
+ * Sets the block size, and the loops built for it. Returns EINVAL if unsupported
+ */
+int set_block_size(unsigned int size) {
+    struct ext2_block_ops ops_1024 = { get_block_table_1024, block_walk_next_1024, dir_iter_next_1024 };
+    struct ext2_block_ops ops_2048 = { get_block_table_2048, block_walk_next_2048, dir_iter_next_2048 };
+    struct ext2_block_ops ops_4096 = { get_block_table_4096, block_walk_next_4096, dir_iter_next_4096 };
+
+    switch (size) {
+        case 1024: block_ops = ops_1024; break;
+        case 2048: block_ops = ops_2048; break;
+        case 4096: block_ops = ops_4096; break;
+        default: return EINVAL;
+    }
+    ext2_block_size = size;
+    return 0;
+}
+
+unsigned int *get_block_table(unsigned char *disk, struct ext2_inode *inode, unsigned int n, int alloc, unsigned int *first, unsigned int *len) {
+    return block_ops.block_table(disk, inode, n, alloc, first, len);
+}
+
+int block_walk_next(struct ext2_block_walk *walk, unsigned int *logical, unsigned int *physical, unsigned int *len) {
+    return block_ops.walk_next(walk, logical, physical, len);
+}
+
+struct ext2_dir_entry_2 *dir_iter_next(struct ext2_dir_iter *it) {
+    return block_ops.dir_next(it);
+}
+
+/*
+ * Gets the logical block n of an inode, 0 if it isn't mapped
+ */
+unsigned int get_block_number(unsigned char *disk, struct ext2_inode *inode, unsigned int n) {
+    unsigned int first, len;
+    unsigned int *table = get_block_table(disk, inode, n, 0, &first, &len);
+    return table ? table[n - first] : 0;
+}
+
+/*
+ * The target of a symlink, i_size bytes of it, from i_block or its first block.
+ * NULL if it has neither
+ */
+const char *link_target(unsigned char *disk, struct ext2_inode *inode) {
+    if (EXT2_IS_FAST_LINK(inode)) return (const char *)inode->i_block;
+
+    unsigned int block = get_block_number(disk, inode, 0);
+    return block ? (const char *)EXT2_BLOCK(disk, block) : NULL;
+}
+
+/*
+ * Maps logical block n of an inode to block, making indirect blocks on the way.
+ * Returns EFBIG if the inode can't have that many blocks
+ */
+int set_block_number(unsigned char *disk, struct ext2_inode *inode, unsigned int n, unsigned int block) {
+    unsigned int first, len;
+    unsigned int *table = get_block_table(disk, inode, n, 1, &first, &len);
+    if (!table) return EFBIG;
+
+    table[n - first] = block;
+    mark_dirty(disk, &table[n - first], sizeof(*table));
+    return 0;
+}
+
+/*
+ * Called with each run of blocks an inode lets go of
+ */
+typedef void (*release_fn)(unsigned char *disk, unsigned int block, unsigned int len, void *params);
+
+/*
+ * Lets go of the indirect blocks under slot that only map logical blocks at or
+ * past keep, and clears their entries. first is the logical block the tree
+ * starts at and depth how many levels of indirect blocks it has
+ */
+void prune_block_tree(unsigned char *disk, struct ext2_inode *inode, unsigned int *slot, unsigned int depth, uint64_t first, unsigned int keep,
+                      release_fn release, void *params) {
+    unsigned int per = EXT2_INDIRECT_BLOCKS, i;
+    uint64_t span = 1;
+    if (!*slot) return;
+
+    for (i = 1; i < depth; i++) span *= per;
+
+    unsigned int *table = (unsigned int *)EXT2_BLOCK(disk, *slot);
+    mark_dirty(disk, table, EXT2_BLOCK_SIZE);
+    for (i = 0; i < per; i++) {
+        if (first + (i + 1) * span <= keep) continue;
+        if (depth > 1) {
+            prune_block_tree(disk, inode, &table[i], depth - 1, first + i * span, keep, release, params);
+        } else {
+            table[i] = 0;
+        }
+    }
+
+    if (first >= keep) {
+        release(disk, *slot, 1, params);
+        EXT2_SET_BLOCKS(inode, EXT2_NUM_BLOCKS(disk, inode) - 1);
+        *slot = 0;
+        mark_dirty(disk, slot, sizeof(*slot));
+    }
+}
+
+/*
+ * Lets go of the blocks of an inode from logical block keep on, and the indirect
+ * blocks no longer needed, passing each run to release. Doesn't touch i_size
+ */
+void release_blocks(unsigned char *disk, struct ext2_inode *inode, unsigned int keep, release_fn release, void *params) {
+    struct ext2_block_walk walk;
+    unsigned int logical, physical, len, i;
+    uint64_t first = EXT2_DIRECT_BLOCKS, span = EXT2_INDIRECT_BLOCKS;
+
+    mark_inode(disk, inode);
+    if (EXT2_IS_FAST_LINK(inode)) return;
+
+    // Data a run at a time, everything that's mapped whatever i_size says
+    block_walk_init(&walk, disk, inode, keep);
+    walk.limit = ~0U;
+    while (block_walk_next(&walk, &logical, &physical, &len)) {
+        if (!physical) continue;
+        release(disk, physical, len, params);
+        EXT2_SET_BLOCKS(inode, EXT2_NUM_BLOCKS(disk, inode) - len);
+    }
+
+    // Then the map itself
+    for (i = keep; i < EXT2_DIRECT_BLOCKS; i++) {
+        inode->i_block[i] = 0;
+    }
+    for (i = 1; i <= 3; i++) {
+        prune_block_tree(disk, inode, &inode->i_block[EXT2_DIRECT_BLOCKS + i - 1], i, first, keep, release, params);
+        first += span;
+        span *= EXT2_INDIRECT_BLOCKS;
+    }
+}
+
+void free_block_run(unsigned char *disk, unsigned int block, unsigned int len, void *params) {
+    set_block_run(disk, block, len, 0);
+}
+
+/*
+ * Frees the blocks of an inode from logical block keep on, and the indirect
+ * blocks no longer needed. Doesn't touch i_size
+ */
+void truncate_blocks(unsigned char *disk, struct ext2_inode *inode, unsigned int keep) {
+    release_blocks(disk, inode, keep, free_block_run, NULL);
+}
+/*
+ * Go over all blocks, passing them one by one into the callback. If callback return 0,
+ * then return block. else keep going. Your welcome...
+ */
+struct ext2_dir_entry_2 *iterate_inode(
+    unsigned char *disk,
+    struct ext2_inode *entry,
+    int (*callback)(struct ext2_dir_entry_2 *, void *),
+    void *params
+) {
+    struct ext2_dir_iter it;
+    struct ext2_dir_entry_2 *block;
+
+    dir_iter_init(&it, disk, entry);
+    while ((block = dir_iter_next(&it))) {
+        if ((*callback)(block, params) == 0) {
+            return block;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Collects the indirect blocks of a map, depth levels above the data
+ */
+void index_blocks(unsigned char *disk, unsigned int block, int depth, unsigned int **list, unsigned int *count, unsigned int *size) {
+    unsigned int *table = (unsigned int *)EXT2_BLOCK(disk, block), i;
+
+    if (*count == *size) {
+        *size = *size ? *size * 2 : 16;
+        *list = realloc(*list, *size * sizeof(unsigned int));
+        assert(*list);
+    }
+    (*list)[(*count)++] = block;
+
+    for (i = 0; depth > 1 && i < EXT2_INDIRECT_BLOCKS; i++) {
+        if (table[i]) index_blocks(disk, table[i], depth - 1, list, count, size);
+    }
+}
+
+int block_number_cmp(const void *a, const void *b) {
+    unsigned int x = *(const unsigned int *)a, y = *(const unsigned int *)b;
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Pieces a file's data is in. Blocks are still in one piece if all that's
+ * between them is the file's own indirect blocks, or a hole
+ */
+unsigned int file_fragments(unsigned char *disk, struct ext2_inode *inode, unsigned int *blocks) {
+    unsigned int logical, physical, len, end = 0, count = 0, i;
+    unsigned int *index = NULL, indexed = 0, size = 0;
+    struct ext2_block_walk walk;
+
+    *blocks = 0;
+    if (EXT2_IS_FAST_LINK(inode)) return 0;
+
+    for (i = 0; i < 3; i++) {
+        if (inode->i_block[EXT2_DIRECT_BLOCKS + i]) index_blocks(disk, inode->i_block[EXT2_DIRECT_BLOCKS + i], i + 1, &index, &indexed, &size);
+    }
+    qsort(index, indexed, sizeof(unsigned int), block_number_cmp);
+
+    block_walk_init(&walk, disk, inode, 0);
+    while (block_walk_next(&walk, &logical, &physical, &len)) {
+        if (!physical) continue;
+        while (end && end < physical && bsearch(&end, index, indexed, sizeof(unsigned int), block_number_cmp)) end++;
+        if (physical != end) count++;
+        end = physical + len;
+        *blocks += len;
+    }
+    free(index);
+    return count;
+}
+
+/*
+ * Lookup (dentry) cache, maps a name in a directory to its entry in the image.
+ * A NULL entry remembers that the name doesn't exist. Slots are only valid for
+ * the current generation, so bumping it drops everything at once.
+ */
+#define EXT2_DCACHE_SIZE 4096
+
+struct ext2_dcache_slot {
+    unsigned int gen;
+    unsigned int parent;
+    unsigned int name_len;
+    char name[EXT2_NAME_LEN];
+    struct ext2_dir_entry_2 *entry;
+};
+
+struct ext2_dcache_slot dcache[EXT2_DCACHE_SIZE];
+unsigned int dcache_gen = 1;
+
+/*
+ * Get the cache slot for a name in a directory (FNV-1a)
+ */
+struct ext2_dcache_slot *dcache_slot(unsigned int parent, struct ext2_name name) {
+    uint32_t hash = 2166136261u ^ parent;
+    unsigned int i;
+    for (i = 0; i < name.len; i++) {
+        hash = (hash ^ (unsigned char)name.ptr[i]) * 16777619u;
+    }
+    return &dcache[hash % EXT2_DCACHE_SIZE];
+}
+
+/*
+ * Look up a name in the cache, returns 1 on hit and sets entry
+ */
+int dcache_lookup(unsigned int parent, struct ext2_name name, struct ext2_dir_entry_2 **entry) {
+    if (name.len > EXT2_NAME_LEN) return 0;
+
+    struct ext2_dcache_slot *slot = dcache_slot(parent, name);
+    if (slot->gen != dcache_gen || slot->parent != parent || slot->name_len != name.len ||
+        memcmp(slot->name, name.ptr, name.len)) {
+        return 0;
+    }
+
+    *entry = slot->entry;
+    return 1;
+}
+
+/*
+ * Remember what a name in a directory resolves to, replacing whatever was in the slot
+ */
+void dcache_insert(unsigned int parent, struct ext2_name name, struct ext2_dir_entry_2 *entry) {
+    if (name.len > EXT2_NAME_LEN) return;
+
+    struct ext2_dcache_slot *slot = dcache_slot(parent, name);
+    slot->gen = dcache_gen;
+    slot->parent = parent;
+    slot->name_len = name.len;
+    memcpy(slot->name, name.ptr, name.len);
+    slot->entry = entry;
+}
+
+/*
+ * Drop everything in the cache, for when entries move or go away
+ */
+void dcache_flush() {
+    dcache_gen++;
+}
+
+/*
+ * Get the entry that matches name from directory inode parent
+ */
+struct ext2_dir_entry_2 *find_name(unsigned char *disk, unsigned int parent, struct ext2_name name) {
+    struct ext2_inode *entry = get_inode(disk, parent);
+    struct ext2_dir_entry_2 *found;
+    struct ext2_dir_iter it;
+
+    if (dcache_lookup(parent, name, &found)) return found;
+
+    // Straight to the right block if indexed, else look through all of them
+    if (dx_find(disk, entry, name, &found)) {
+        dir_iter_init(&it, disk, entry);
+        while ((found = dir_iter_next(&it)) && !(found->inode && name_eq(entry_name(found), name)));
+    }
+    dcache_insert(parent, name, found);
+    return found;
+}
+
+struct ext2_dir_entry_2 *find_file(unsigned char *disk, unsigned int parent, char *name) {
+    return find_name(disk, parent, str_name(name));
+}
+
+/*
+ * Removes all blocks from inode
+ */
+void free_blocks(unsigned char *disk, unsigned int inode) {
+    struct ext2_inode *file = get_inode(disk, inode);
+    truncate_blocks(disk, file, 0);
+    EXT2_SET_BLOCKS(file, 0);
+    mark_inode(disk, file);
+}
+
+/*
+ * Adds an empty block to the end of a directory, returns the block. Sets logical
+ * to its index in the directory if given
+ */
+unsigned char *add_dir_block(unsigned char *disk, struct ext2_inode *dir_inode, unsigned int *logical) {
+    unsigned int index = EXT2_DIR_BLOCKS(dir_inode);
+
+    // Setup new block with a single unused entry
+    int block_index = get_free_block(disk, inode_block_group(disk, dir_inode));
+    if (block_index < 0) {
+        fprintf(stderr, "No space left on disk\n");
+        exit(ENOSPC);
+    }
+    set_block_bitmap(disk, block_index, 1);
+    unsigned char *block = EXT2_BLOCK(disk, block_index);
+    struct ext2_dir_entry_2 *entry = (struct ext2_dir_entry_2 *)block;
+    memset(block, '\0', EXT2_BLOCK_SIZE);
+    entry->rec_len = EXT2_BLOCK_SIZE;
+    mark_dirty(disk, block, EXT2_BLOCK_SIZE);
+
+    // Map it, along with any indirect blocks needed
+    if (set_block_number(disk, dir_inode, index, block_index)) {
+        fprintf(stderr, "No space in directory\n");
+        exit(ENOSPC);
+    }
+
+    EXT2_SET_BLOCKS(dir_inode, EXT2_NUM_BLOCKS(disk, dir_inode) + 1);
+    dir_inode->i_size += EXT2_BLOCK_SIZE;
+    mark_inode(disk, dir_inode);
+    if (logical) *logical = index;
+    return block;
+}
+
+/*
+ * Drops the blocks of a directory past the first count
+ */
+void truncate_dir_blocks(unsigned char *disk, struct ext2_inode *dir_inode, unsigned int count) {
+    truncate_blocks(disk, dir_inode, count);
+    dir_inode->i_size = count * EXT2_BLOCK_SIZE;
+    mark_inode(disk, dir_inode);
+}
+
+/*
+ * Makes room for an entry of required size out of an existing one, if it can.
+ * Unused entries are taken whole, else the slack at the end is split off.
+ */
+struct ext2_dir_entry_2 *make_room(struct ext2_dir_entry_2 *entry, int required) {
+    if (!entry->inode) {
+        return entry->rec_len >= required ? entry : NULL;
+    }
+
+    unsigned int actual = EXT2_ENTRY_SIZE(entry);
+    if (entry->rec_len - actual < required) return NULL;
+
+    struct ext2_dir_entry_2 *new_entry = (struct ext2_dir_entry_2 *)((char *)entry + actual);
+    new_entry->rec_len = entry->rec_len - actual;
+    entry->rec_len = actual;
+    return new_entry;
+}
+
+/*
+ * Adds an entry for inode to the directory, for when the inode already exists
+ */
+struct ext2_dir_entry_2 *add_link(unsigned char *disk, struct ext2_dir_entry_2 *dir, char *name, unsigned int type, unsigned int inode) {
+    struct ext2_inode *dir_inode = get_inode(disk, dir->inode);
+    struct ext2_dir_entry_2 *new_entry = NULL, *entry;
+    int required = EXT2_DIR_SIZE(name);
+    struct ext2_dir_iter it;
+
+    // Indexed directories put it in the block for its hash
+    if (dx_is_indexed(disk, dir_inode)) {
+        new_entry = dx_add(disk, dir_inode, name, required);
+    }
+
+    // Else the first entry with space
+    dir_iter_init(&it, disk, dir_inode);
+    while (!new_entry && (entry = dir_iter_next(&it))) {
+        new_entry = make_room(entry, required);
+    }
+
+    // Directories get an index when they outgrow a few blocks, on images that
+    // have indexes turned on (see ext2_index)
+    if (!new_entry && (EXT2_SUPER_BLOCK(disk)->s_feature_compat & EXT2_FEATURE_COMPAT_DIR_INDEX) &&
+        !dx_is_indexed(disk, dir_inode) && EXT2_DIR_BLOCKS(dir_inode) == EXT2_DX_MIN_BLOCKS && !dx_build(disk, dir_inode)) {
+        new_entry = dx_add(disk, dir_inode, name, required);
+    }
+
+    // Else a new block
+    if (!new_entry) {
+        new_entry = (struct ext2_dir_entry_2 *)add_dir_block(disk, dir_inode, NULL);
+    }
+
+    // Set the fields
+    new_entry->inode = inode;
+    new_entry->name_len = strlen(name);
+    new_entry->file_type = type;
+    memcpy(new_entry->name, name, strlen(name));
+    mark_dirty(disk, new_entry, new_entry->rec_len);
+
+    // Return new file
+    dcache_insert(dir->inode, str_name(name), new_entry);
+    return new_entry;
+}
+
+/*
+ * Adds a thing to the directory, with a new inode
+ */
+struct ext2_dir_entry_2 *add_thing(unsigned char *disk, struct ext2_dir_entry_2 *dir, char *name, unsigned int type) {
+    int inode = get_free_inode(disk, find_inode_group(disk, dir->inode, type == EXT2_FT_DIR));
+    if (inode < 0) {
+        fprintf(stderr, "No free inodes left on disk\n");
+        exit(ENOSPC);
+    }
+    set_inode_bitmap(disk, inode, 1);
+    memset(get_inode(disk, inode), 0, EXT2_INODE_SIZE(disk));
+    mark_inode(disk, get_inode(disk, inode));
+
+    return add_link(disk, dir, name, type, inode);
+}
+
+/*
+ * Makes an empty directory called name in dir, with . and .. in it
+ */
+struct ext2_dir_entry_2 *add_dir(unsigned char *disk, struct ext2_dir_entry_2 *dir, char *name) {
+    struct ext2_dir_entry_2 *new_dir_entry = add_thing(disk, dir, name, EXT2_FT_DIR);
+    unsigned int parent = dir->inode;
+
+    // Setup directory
+    struct ext2_inode *new_dir_inode = get_inode(disk, new_dir_entry->inode);
+    memset(new_dir_inode->i_block, 0, sizeof(new_dir_inode->i_block));
+    EXT2_SET_BLOCKS(new_dir_inode, 0);
+    new_dir_inode->i_size = 0;
+    new_dir_inode->i_flags = 0;
+    new_dir_inode->i_mode = EXT2_S_IFDIR;
+    new_dir_inode->i_links_count = 2;
+    mark_inode(disk, new_dir_inode);
+
+    struct ext2_group_desc *desc = get_group_desc(disk, inode_group(disk, new_dir_entry->inode));
+    desc->bg_used_dirs_count++;
+    mark_dirty(disk, desc, sizeof(*desc));
+
+    // The . and .. Shortcuts fill its first block, they're links so take no inodes
+    struct ext2_dir_entry_2 *curr_dir_link = (struct ext2_dir_entry_2 *)add_dir_block(disk, new_dir_inode, NULL);
+    struct ext2_dir_entry_2 *parent_dir_link;
+    curr_dir_link->inode = new_dir_entry->inode;
+    curr_dir_link->rec_len = EXT2_DIR_SIZE(".");
+    curr_dir_link->name_len = 1;
+    curr_dir_link->file_type = EXT2_FT_DIR;
+    memcpy(curr_dir_link->name, ".", 1);
+
+    parent_dir_link = EXT2_NEXT_FILE(curr_dir_link);
+    parent_dir_link->inode = parent;
+    parent_dir_link->rec_len = EXT2_BLOCK_SIZE - curr_dir_link->rec_len;
+    parent_dir_link->name_len = 2;
+    parent_dir_link->file_type = EXT2_FT_DIR;
+    memcpy(parent_dir_link->name, "..", 2);
+
+    get_inode(disk, parent)->i_links_count++;
+    mark_inode(disk, get_inode(disk, parent));
+
+    return new_dir_entry;
+}
+
+/*
+ * Gets the next component of a path, moving past it. Returns 0 if there are no more
+ */
+int path_next(char **path, struct ext2_name *token) {
+    char *p = *path;
+    while (*p == '/') p++;
+
+    token->ptr = p;
+    while (*p && *p != '/') p++;
+    token->len = p - token->ptr;
+
+    *path = p;
+    return token->len > 0;
+}
+
+/*
+ * Given an absolute path, navigate to the block entry
+ */
+struct ext2_dir_entry_2 *navigate(unsigned char *disk, char *path) {
+    unsigned int inode = EXT2_ROOT_INO; // Root directory
+    struct ext2_dir_entry_2 *entry = find_file(disk, inode, ".");
+    struct ext2_name token;
+    int more = path_next(&path, &token);
+
+    while (more) {
+        entry = find_name(disk, inode, token);
+        more = path_next(&path, &token);
+        // If subdirectory is a file, return NULL. Else return the last file
+        if (!EXT2_IS_DIRECTORY(entry)) {
+            return more ? NULL : entry;
+        }
+        inode = entry->inode;
+    }
+
+    // Return the file/directory
+    return entry;
+}
+
+/*
+ * Path of an entry in the directory at dir, to be freed
+ */
+char *join_path(const char *dir, struct ext2_dir_entry_2 *entry) {
+    size_t len = strlen(dir);
+    char *path = malloc(len + entry->name_len + 2);
+    assert(path);
+    memcpy(path, dir, len);
+    if (!len || dir[len - 1] != '/') path[len++] = '/';
+    memcpy(path + len, entry->name, entry->name_len);
+    path[len + entry->name_len] = '\0';
+    return path;
+}
+
+typedef void (*tree_fn)(unsigned char *disk, unsigned int parent, const char *path, struct ext2_dir_entry_2 *entry, void *params);
+
+struct ext2_tree_dir {
+    unsigned int inode;
+    char *path;
+};
+
+/*
+ * Goes through every directory from the root, calling fn with each entry but
+ * the dots. Every directory's entries come before those of the ones in it
+ */
+void walk_tree(unsigned char *disk, tree_fn fn, void *params) {
+    struct ext2_tree_dir *dirs = malloc(64 * sizeof(struct ext2_tree_dir));
+    struct ext2_dir_entry_2 *entry;
+    struct ext2_dir_iter it;
+    size_t count = 1, size = 64, next;
+
+    assert(dirs);
+    dirs[0].inode = EXT2_ROOT_INO;
+    dirs[0].path = strdup("/");
+
+    for (next = 0; next < count; next++) {
+        struct ext2_tree_dir dir = dirs[next];
+
+        dir_iter_init(&it, disk, get_inode(disk, dir.inode));
+        while ((entry = dir_iter_next(&it))) {
+            if (!entry->inode || name_is_dots(entry_name(entry))) continue;
+
+            char *path = join_path(dir.path, entry);
+            fn(disk, dir.inode, path, entry, params);
+            if (!EXT2_IS_DIRECTORY(entry)) {
+                free(path);
+                continue;
+            }
+
+            if (count == size) {
+                size *= 2;
+                dirs = realloc(dirs, size * sizeof(struct ext2_tree_dir));
+                assert(dirs);
+            }
+            dirs[count].inode = entry->inode;
+            dirs[count].path = path;
+            count++;
+        }
+        free(dir.path);
+    }
+    free(dirs);
+}
+
+#define RM_MAX_WORKERS 8
+
+unsigned int remove_workers;    // Workers remove_dir uses, 0 for one per CPU
+
+/*
+ * Growable list of pairs, runs of blocks (block, len) or inodes (inode, is_dir)
+ */
+struct rm_pair {
+    unsigned int a;
+    unsigned int b;
+};
+
+struct rm_list {
+    struct rm_pair *items;
+    size_t count;
+    size_t size;
+};
+
+void rm_push(struct rm_list *list, unsigned int a, unsigned int b) {
+    if (list->count == list->size) {
+        list->size = list->size ? list->size * 2 : 64;
+        list->items = realloc(list->items, list->size * sizeof(struct rm_pair));
+        assert(list->items);
+    }
+    list->items[list->count].a = a;
+    list->items[list->count].b = b;
+    list->count++;
+}
+
+void rm_append(struct rm_list *list, struct rm_list *other) {
+    size_t i;
+    for (i = 0; i < other->count; i++) {
+        rm_push(list, other->items[i].a, other->items[i].b);
+    }
+    free(other->items);
+    memset(other, 0, sizeof(*other));
+}
+
+int rm_pair_cmp(const void *a, const void *b) {
+    unsigned int x = ((const struct rm_pair *)a)->a, y = ((const struct rm_pair *)b)->a;
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * A removal, shared by the workers if there are any. Directories are handed
+ * out from the queue. Workers only touch inodes and block maps, and note what
+ * to free. The bitmaps are done all at once after, so nothing else is shared.
+ */
+struct rm_job {
+    unsigned char *disk;
+    unsigned int now;           // Deletion time for everything
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct rm_list queue;       // Directories left to go through
+    unsigned int busy;          // Workers going through one
+    struct rm_list runs;        // Blocks to free
+    struct rm_list inodes;      // Inodes to free
+};
+
+/*
+ * Worker's own notes, merged into the job when it's done
+ */
+struct rm_local {
+    struct rm_list runs;
+    struct rm_list inodes;
+    struct rm_list dirs;
+};
+
+void rm_note_run(unsigned char *disk, unsigned int block, unsigned int len, void *params) {
+    rm_push(&((struct rm_local *)params)->runs, block, len);
+}
+
+/*
+ * Drops a link to a file, and its content with the last one. Only the worker
+ * taking the count to 0 goes on
+ */
+void rm_file(struct rm_job *job, struct rm_local *local, unsigned int number) {
+    struct ext2_inode *inode = get_inode(job->disk, number);
+    unsigned char *disk = job->disk;
+    unsigned short links = __atomic_load_n(&inode->i_links_count, __ATOMIC_ACQUIRE), next;
+
+    do {
+        if (!links) return;
+        next = links - 1;
+    } while (!__atomic_compare_exchange_n(&inode->i_links_count, &links, next, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+    mark_inode(disk, inode);
+    if (next) return;
+
+    inode->i_dtime = job->now;
+    release_blocks(disk, inode, 0, rm_note_run, local);
+    EXT2_SET_BLOCKS(inode, 0);
+    inode->i_size = 0;
+    rm_push(&local->inodes, number, 0);
+}
+
+/*
+ * Goes through a directory, removing the files in it and queueing the
+ * directories, then lets go of the directory itself
+ */
+void rm_dir(struct rm_job *job, struct rm_local *local, unsigned int number) {
+    struct ext2_inode *inode = get_inode(job->disk, number);
+    unsigned char *disk = job->disk;
+    struct ext2_dir_entry_2 *entry;
+    struct ext2_dir_iter it;
+
+    inode->i_links_count = 0;
+    inode->i_dtime = job->now;
+
+    // Contents before the actual blocks, but not . and ..
+    dir_iter_init(&it, disk, inode);
+    while ((entry = dir_iter_next(&it))) {
+        if (!entry->inode || name_is_dots(entry_name(entry))) continue;
+
+        if (EXT2_IS_DIRECTORY(entry)) {
+            rm_push(&local->dirs, entry->inode, 1);
+        } else {
+            rm_file(job, local, entry->inode);
+        }
+    }
+
+    release_blocks(disk, inode, 0, rm_note_run, local);
+    EXT2_SET_BLOCKS(inode, 0);
+    inode->i_size = 0;
+    inode->i_flags &= ~EXT2_INDEX_FL;
+    rm_push(&local->inodes, number, 1);
+}
+
+void *rm_worker(void *arg) {
+    struct rm_job *job = arg;
+    struct rm_local local = {{0}};
+    unsigned int number;
+
+    pthread_mutex_lock(&job->lock);
+    while (1) {
+        while (!job->queue.count && job->busy) {
+            pthread_cond_wait(&job->cond, &job->lock);
+        }
+        if (!job->queue.count) break;
+
+        number = job->queue.items[--job->queue.count].a;
+        job->busy++;
+        pthread_mutex_unlock(&job->lock);
+
+        rm_dir(job, &local, number);
+
+        // Hand out the directories found in it
+        pthread_mutex_lock(&job->lock);
+        job->busy--;
+        if (local.dirs.count || !job->busy) {
+            while (local.dirs.count) {
+                rm_push(&job->queue, local.dirs.items[--local.dirs.count].a, 1);
+            }
+            pthread_cond_broadcast(&job->cond);
+        }
+    }
+
+    rm_append(&job->runs, &local.runs);
+    rm_append(&job->inodes, &local.inodes);
+    pthread_mutex_unlock(&job->lock);
+    free(local.dirs.items);
+    return NULL;
+}
+
+/*
+ * Frees everything a removal noted, in bulk, neighbouring runs together
+ */
+void rm_finish(struct rm_job *job) {
+    unsigned char *disk = job->disk;
+    size_t j;
+
+    qsort(job->runs.items, job->runs.count, sizeof(struct rm_pair), rm_pair_cmp);
+    for (j = 0; j < job->runs.count; j++) {
+        unsigned int block = job->runs.items[j].a, len = job->runs.items[j].b;
+        while (j + 1 < job->runs.count && job->runs.items[j + 1].a == block + len) {
+            len += job->runs.items[++j].b;
+        }
+        set_block_run(disk, block, len, 0);
+    }
+
+    qsort(job->inodes.items, job->inodes.count, sizeof(struct rm_pair), rm_pair_cmp);
+    for (j = 0; j < job->inodes.count; j++) {
+        set_inode_bitmap(disk, job->inodes.items[j].a, 0);
+        if (job->inodes.items[j].b) {
+            struct ext2_group_desc *desc = get_group_desc(disk, inode_group(disk, job->inodes.items[j].a));
+            desc->bg_used_dirs_count--;
+            mark_dirty(disk, desc, sizeof(*desc));
+        }
+    }
+
+    free(job->queue.items);
+    free(job->runs.items);
+    free(job->inodes.items);
+    pthread_mutex_destroy(&job->lock);
+    pthread_cond_destroy(&job->cond);
+}
+
+void rm_start(struct rm_job *job, unsigned char *disk) {
+    memset(job, 0, sizeof(*job));
+    job->disk = disk;
+    job->now = time(0);
+    pthread_mutex_init(&job->lock, NULL);
+    pthread_cond_init(&job->cond, NULL);
+}
+
+/*
+ * Removes the content and inode of a file, or a link to it
+ */
+void remove_file(unsigned char *disk, struct ext2_dir_entry_2 *file) {
+    struct rm_local local = {{0}};
+    struct rm_job job;
+
+    rm_start(&job, disk);
+    rm_file(&job, &local, file->inode);
+    rm_append(&job.runs, &local.runs);
+    rm_append(&job.inodes, &local.inodes);
+    rm_finish(&job);
+}
+
+/*
+ * Removes a directory, everything under it and its inode, with remove_workers
+ * workers. With one it's all done on this thread, and the image ends up the
+ * same however many there are
+ */
+void remove_dir(unsigned char *disk, struct ext2_dir_entry_2 *dir) {
+    pthread_t workers[RM_MAX_WORKERS];
+    long cpus = remove_workers ? remove_workers : sysconf(_SC_NPROCESSORS_ONLN);
+    int count = MAX(1, MIN(cpus, RM_MAX_WORKERS)), started = 0, i;
+    struct rm_job job;
+
+    rm_start(&job, disk);
+    rm_push(&job.queue, dir->inode, 1);
+
+    if (count > 1) {
+        for (; started < count; started++) {
+            if (pthread_create(&workers[started], NULL, rm_worker, &job)) break;
+        }
+    }
+    if (!started) rm_worker(&job);
+    for (i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    rm_finish(&job);
+}
+
+/*
+ * Takes an entry out of the directory block it's in
+ */
+void unlink_entry(unsigned char *disk, struct ext2_dir_entry_2 *entry) {
+    // It's in the block it points into
+    unsigned int offset = ((unsigned char *)entry - disk) % EXT2_BLOCK_SIZE;
+    struct ext2_dir_entry_2 *block = (struct ext2_dir_entry_2 *)((unsigned char *)entry - offset);
+    struct ext2_dir_entry_2 *last_block = NULL;
+
+    mark_dirty(disk, entry, entry->rec_len);
+    entry->file_type = EXT2_FT_UNKNOWN;
+    while (block != entry) {
+        last_block = block;
+        block = EXT2_NEXT_FILE(block);
+    }
+
+    // If has last block, extend that. Else it's first in the block, so mark unused
+    if (last_block) {
+        last_block->rec_len += entry->rec_len;
+    } else {
+        entry->inode = 0;
+    }
+}
+
+/*
+ * Removes an entry from a directory
  */
 void remove_entry(unsigned char *disk, struct ext2_dir_entry_2 *dir, struct ext2_dir_entry_2 *entry) {
-    // Step 1: Deal with entry
+    // Whole subtrees can go, and their entries with them
+    dcache_flush();
+
+    // Deal with entry, then take it out of dir
     struct ext2_inode *inode = get_inode(disk, dir->inode);
     if (EXT2_IS_DIRECTORY(entry)) {
         inode->i_links_count--; // Remove .. link from directory;
+        mark_inode(disk, inode);
         remove_dir(disk, entry);
     } else {
         remove_file(disk, entry);
     }
 
-    // Step 2: Deal with dir containing this entry
-    int *blocks = inode_to_blocks(disk, inode);
-    int limit = EXT2_NUM_BLOCKS(disk, inode);
-    struct ext2_dir_entry_2 *last_block, *block;
-    int i, j;
-
-    char *entry_name = get_name(entry);
-    entry->file_type = EXT2_FT_UNKNOWN;
-    for (i = 0; i < limit; i++) {
-        block = (struct ext2_dir_entry_2 *)EXT2_BLOCK(disk, blocks[i]);
-        last_block = NULL;
-
-        // Loop through entries in block
-        for (j = 0; j < EXT2_BLOCK_SIZE; block = EXT2_NEXT_FILE(block)) {
-            char *name = get_name(block);
-            if (!strcmp(name, entry_name)) {
-                // If only block, then remove block and shift
-                if (entry->rec_len == EXT2_BLOCK_SIZE) {
-                    EXT2_SET_BLOCKS(inode, limit - 1);
-                    set_block_bitmap(disk, blocks[i], 0);
-                    blocks[i] = blocks[i + 1];
-
-                // If has last block, extend that
-                } else if (last_block) {
-                    last_block->rec_len += entry->rec_len;
-
-                // If first in block
-                } else {
-                    // Update len
-                    last_block = EXT2_NEXT_FILE(entry);
-                    last_block->rec_len += entry->rec_len;
-
-                    // Shift to first
-                    char *name = get_name(last_block);
-                    memcpy(entry, last_block, EXT2_DIR_SIZE(name));
-                    free(name);
-                }
-            }
-            j += block->rec_len;
-            last_block = block;
-            free(name);
-        }
-    }
-    free(entry_name);
-    free(blocks);
+    unlink_entry(disk, entry);
 }
+
+#include "ext2_htree.h"
+
+#endif
@@ -1,167 +1,428 @@
-
 #include <stdio.h>
 #include <unistd.h>
-#include <stdlib.h>
-#include <sys/types.h>
-#include <sys/stat.h>
-#include <fcntl.h>
-#include <sys/mman.h>
-#include "ext2.h"
-
-unsigned char *disk;
-
-struct dir{
-    unsigned int block_no;
-    unsigned int inode_no;
-   struct ext2_dir_entry_2 *d;
-   struct dir * next;
-   struct ext2_inode *in;
+#include "ext2_welp.h"
+
+char *usage = "USAGE: %s disk [--json|--binary]\n";
+
+#define DUMP_TEXT 0         // For people, bitmaps bit by bit
+#define DUMP_JSON 1         // One object, for monitoring
+#define DUMP_BINARY 2       // Records, see below
+
+/*
+ * --binary is a stream of records, each a header and then length bytes of
+ * payload, in host byte order. It starts with a super record, then a group
+ * record per group, an inode record per inode in use and an entry record per
+ * directory entry, parents before their children, and ends with an end record
+ */
+#define DUMP_MAGIC 0x44325845       // "EX2D"
+#define DUMP_VERSION 1
+
+#define DUMP_SUPER 1
+#define DUMP_GROUP 2
+#define DUMP_INODE 3        // Followed by runs of struct dump_run
+#define DUMP_ENTRY 4        // Followed by the name, padded to 4 bytes
+#define DUMP_END 5
+
+struct dump_record {
+	uint16_t type;
+	uint16_t version;
+	uint32_t length;
+};
+
+struct dump_super {
+	uint32_t magic;
+	uint32_t block_size;
+	uint32_t inodes_count;
+	uint32_t blocks_count;
+	uint32_t r_blocks_count;
+	uint32_t free_blocks_count;
+	uint32_t free_inodes_count;
+	uint32_t first_data_block;
+	uint32_t blocks_per_group;
+	uint32_t inodes_per_group;
+	uint32_t first_ino;
+	uint32_t inode_size;
+	uint32_t groups;
+	uint32_t mtime;
+	uint32_t wtime;
+	uint32_t state;
+};
+
+struct dump_group {
+	uint32_t group;
+	uint32_t block_bitmap;
+	uint32_t inode_bitmap;
+	uint32_t inode_table;
+	uint32_t free_blocks_count;         // What the descriptor says
+	uint32_t free_inodes_count;
+	uint32_t used_dirs_count;
+	uint32_t bitmap_free_blocks;        // What the bitmaps say
+	uint32_t bitmap_free_inodes;
 };
 
-struct dir *head;
-struct dir *last;
+struct dump_inode {
+	uint32_t inode;
+	uint32_t mode;
+	uint32_t links_count;
+	uint32_t size;
+	uint32_t blocks;
+	uint32_t mtime;
+	uint32_t dtime;
+	uint32_t runs;
+};
+
+struct dump_run {
+	uint32_t logical;
+	uint32_t physical;
+	uint32_t len;
+};
+
+struct dump_entry {
+	uint32_t inode;
+	uint32_t parent;
+	uint32_t file_type;
+	uint32_t name_len;
+};
+
+struct ext2_out out;
+
+/*
+ * Each byte of a bitmap as text, a space then the bits lowest first
+ */
+char bitmap_text[256][9];
+
+void bitmap_text_init() {
+	int byte, bit;
+	for (byte = 0; byte < 256; byte++) {
+		bitmap_text[byte][0] = ' ';
+		for (bit = 0; bit < 8; bit++) {
+			bitmap_text[byte][bit + 1] = '0' + ((byte >> bit) & 1);
+		}
+	}
+}
+
+/*
+ * Puts out the first bytes of a bitmap as text
+ */
+void dump_bitmap_text(unsigned char *map, unsigned int bytes) {
+	unsigned int i;
+	for (i = 0; i < bytes; i++) {
+		out_write(&out, bitmap_text[map[i]], 9);
+	}
+}
+
+/*
+ * Puts out count bytes of the bitmaps of all groups as text, per bytes of each
+ */
+void dump_bitmaps_text(unsigned char *disk, int inodes, unsigned int count, unsigned int per) {
+	unsigned int groups = EXT2_GROUP_COUNT(disk), group, bytes;
+	for (group = 0; group < groups && count; group++) {
+		struct ext2_group_desc *desc = get_group_desc(disk, group);
+		bytes = MIN(count, per);
+		dump_bitmap_text(EXT2_BLOCK(disk, inodes ? desc->bg_inode_bitmap : desc->bg_block_bitmap), bytes);
+		count -= bytes;
+	}
+}
+
+int inode_used(unsigned char *disk, unsigned int number) {
+	unsigned int per_group = EXT2_SUPER_BLOCK(disk)->s_inodes_per_group, index = (number - 1) % per_group;
+	unsigned char *map = EXT2_BLOCK(disk, get_group_desc(disk, inode_group(disk, number))->bg_inode_bitmap);
+	return (map[index / 8] >> (index % 8)) & 1;
+}
+
+/*
+ * Inodes worth showing, the root and everything past the reserved ones
+ */
+int inode_shown(unsigned char *disk, unsigned int number) {
+	return (number == EXT2_ROOT_INO || number >= EXT2_FIRST_INO(disk)) && inode_used(disk, number);
+}
+
+char inode_type(struct ext2_inode *inode) {
+	switch (inode->i_mode & 0xF000) {
+	case EXT2_S_IFDIR: return 'd';
+	case EXT2_S_IFREG: return 'f';
+	case EXT2_S_IFLNK: return 'l';
+	}
+	return '?';
+}
+
+char entry_type(struct ext2_dir_entry_2 *entry) {
+	switch (entry->file_type) {
+	case EXT2_FT_DIR: return 'd';
+	case EXT2_FT_REG_FILE: return 'f';
+	case EXT2_FT_SYMLINK: return 'l';
+	}
+	return '0';
+}
+
+/*
+ * Inodes the text dump shows: the root, inode 3 and those after the first
+ * unreserved one, up to the last, that have a size. Anything without the
+ * regular file bit is a directory. All as it always has been, for whatever
+ * reads it
+ */
+int text_shown(unsigned char *disk, unsigned int number) {
+	return (number < 4 || number > EXT2_GOOD_OLD_FIRST_INO) && number <= EXT2_SUPER_BLOCK(disk)->s_inodes_count &&
+		get_inode(disk, number)->i_size;
+}
+
+char text_type(struct ext2_inode *inode) {
+	return inode->i_mode & EXT2_S_IFREG ? 'f' : 'd';
+}
+
+char text_entry_type(struct ext2_dir_entry_2 *entry) {
+	return entry->file_type == EXT2_FT_REG_FILE ? 'f' : entry->file_type == EXT2_FT_DIR ? 'd' : '0';
+}
+
+/*
+ * The text dump: counts, bitmaps, inodes and their direct blocks, then what's
+ * in the last of those for each directory. Its format is fixed, anything new
+ * goes in the other dumps
+ */
+void dump_text(unsigned char *disk) {
+	struct ext2_super_block *sb = EXT2_SUPER_BLOCK(disk);
+	unsigned int groups = EXT2_GROUP_COUNT(disk), group, number, blocks, i;
+
+	out_printf(&out, "Inodes: %u\n", sb->s_inodes_count);
+	out_printf(&out, "Blocks: %u\n", sb->s_blocks_count);
+	for (group = 0; group < groups; group++) {
+		struct ext2_group_desc *desc = get_group_desc(disk, group);
+		out_printf(&out, "Block group:\n");
+		out_printf(&out, "   block bitmap: %u\n", desc->bg_block_bitmap);
+		out_printf(&out, "   inode bitmap: %u\n", desc->bg_inode_bitmap);
+		out_printf(&out, "   inode table: %u\n", desc->bg_inode_table);
+		out_printf(&out, "   free blocks: %u\n", desc->bg_free_blocks_count);
+		out_printf(&out, "   free inodes: %u\n", desc->bg_free_inodes_count);
+		out_printf(&out, "   used dirs: %u\n", desc->bg_used_dirs_count);
+	}
+
+	// Whole bytes, a bit for every block including the first data block
+	out_printf(&out, "Block bitmap:");
+	dump_bitmaps_text(disk, 0, sb->s_blocks_count / 8, sb->s_blocks_per_group / 8);
+	out_printf(&out, "\nInode bitmap:");
+	dump_bitmaps_text(disk, 1, sb->s_inodes_count / 8, sb->s_inodes_per_group / 8);
+
+	// Each block is on a line of its own, and the next inode follows on from
+	// the Blocks: of one without any
+	out_printf(&out, "\n\nInodes:\n");
+	for (number = 2; number <= sb->s_inodes_count; number++) {
+		if (!text_shown(disk, number)) continue;
+		struct ext2_inode *inode = get_inode(disk, number);
+
+		out_printf(&out, "[%u] type: %c size: %u links: %u blocks: %u\n", number, text_type(inode), inode->i_size, inode->i_links_count, inode->i_blocks);
+		out_printf(&out, "[%u] Blocks: ", number);
+		blocks = MIN(EXT2_NUM_BLOCKS(disk, inode), EXT2_DIRECT_BLOCKS);
+		for (i = 0; i < blocks; i++) {
+			out_printf(&out, " %u\n", inode->i_block[i]);
+		}
+	}
+
+	out_printf(&out, "\nDirectory Blocks:\n");
+	for (number = 2; number <= sb->s_inodes_count; number++) {
+		if (!text_shown(disk, number)) continue;
+		struct ext2_inode *inode = get_inode(disk, number);
+		blocks = MIN(EXT2_NUM_BLOCKS(disk, inode), EXT2_DIRECT_BLOCKS);
+		if (text_type(inode) != 'd' || !blocks) continue;
+
+		unsigned char *block = EXT2_BLOCK(disk, inode->i_block[blocks - 1]), *pos;
+		struct ext2_dir_entry_2 *entry;
+
+		out_printf(&out, "   DIR BLOCK NUM: %u (for inode %u)\n", inode->i_block[blocks - 1], number);
+		for (pos = block; pos < block + EXT2_BLOCK_SIZE; pos += entry->rec_len) {
+			entry = (struct ext2_dir_entry_2 *)pos;
+			if (entry->rec_len < 8) break;
+			out_printf(&out, "Inode: %u rec_len: %u name_len: %u type= %c name=%.*s\n", entry->inode, entry->rec_len,
+				entry->name_len, text_entry_type(entry), entry->name_len, entry->name);
+		}
+	}
+}
+
+/*
+ * A string for JSON, names being whatever bytes they are
+ */
+void json_string(const char *str, size_t len) {
+	size_t i;
+	out_write(&out, "\"", 1);
+	for (i = 0; i < len; i++) {
+		unsigned char c = str[i];
+		if (c == '"' || c == '\\') {
+			char escaped[2] = { '\\', c };
+			out_write(&out, escaped, 2);
+		} else if (c < 0x20) {
+			out_printf(&out, "\\u%04x", c);
+		} else {
+			out_write(&out, &str[i], 1);
+		}
+	}
+	out_write(&out, "\"", 1);
+}
+
+void json_entry(unsigned char *disk, unsigned int parent, const char *path, struct ext2_dir_entry_2 *entry, void *params) {
+	int *first = params;
+	out_printf(&out, "%s\n{\"inode\":%u,\"parent\":%u,\"type\":\"%c\",\"path\":", *first ? "" : ",", entry->inode, parent, entry_type(entry));
+	json_string(path, strlen(path));
+	out_write(&out, "}", 1);
+	*first = 0;
+}
+
+/*
+ * The JSON dump, one object with the superblock, groups, inodes and tree. Runs
+ * are [logical, physical, length], holes left out
+ */
+void dump_json(unsigned char *disk) {
+	struct ext2_super_block *sb = EXT2_SUPER_BLOCK(disk);
+	unsigned int groups = EXT2_GROUP_COUNT(disk), group, number, logical, physical, len;
+	struct ext2_block_walk walk;
+	int first = 1;
+
+	out_printf(&out, "{\"superblock\":{\"block_size\":%u,\"inodes_count\":%u,\"blocks_count\":%u,\"r_blocks_count\":%u,"
+		"\"free_blocks_count\":%u,\"free_inodes_count\":%u,\"first_data_block\":%u,\"blocks_per_group\":%u,"
+		"\"inodes_per_group\":%u,\"first_ino\":%u,\"inode_size\":%u,\"groups\":%u,\"mtime\":%u,\"wtime\":%u,\"state\":%u},\n",
+		EXT2_BLOCK_SIZE, sb->s_inodes_count, sb->s_blocks_count, sb->s_r_blocks_count, sb->s_free_blocks_count,
+		sb->s_free_inodes_count, sb->s_first_data_block, sb->s_blocks_per_group, sb->s_inodes_per_group,
+		EXT2_FIRST_INO(disk), (unsigned int)EXT2_INODE_SIZE(disk), groups, sb->s_mtime, sb->s_wtime, sb->s_state);
+
+	out_printf(&out, "\"groups\":[");
+	for (group = 0; group < groups; group++) {
+		struct ext2_group_desc *desc = get_group_desc(disk, group);
+		unsigned int blocks = group_blocks(disk, group);
+		out_printf(&out, "%s\n{\"group\":%u,\"block_bitmap\":%u,\"inode_bitmap\":%u,\"inode_table\":%u,\"free_blocks_count\":%u,"
+			"\"free_inodes_count\":%u,\"used_dirs_count\":%u,\"bitmap_free_blocks\":%u,\"bitmap_free_inodes\":%u}",
+			group ? "," : "", group, desc->bg_block_bitmap, desc->bg_inode_bitmap, desc->bg_inode_table,
+			desc->bg_free_blocks_count, desc->bg_free_inodes_count, desc->bg_used_dirs_count,
+			blocks - bitmap_used(EXT2_BLOCK(disk, desc->bg_block_bitmap), blocks),
+			sb->s_inodes_per_group - bitmap_used(EXT2_BLOCK(disk, desc->bg_inode_bitmap), sb->s_inodes_per_group));
+	}
+
+	out_printf(&out, "],\n\"inodes\":[");
+	for (number = 1; number <= sb->s_inodes_count; number++) {
+		if (!inode_shown(disk, number)) continue;
+		struct ext2_inode *inode = get_inode(disk, number);
+		int run = 0;
+
+		out_printf(&out, "%s\n{\"inode\":%u,\"type\":\"%c\",\"mode\":%u,\"links_count\":%u,\"size\":%u,\"blocks\":%u,"
+			"\"mtime\":%u,\"dtime\":%u,\"runs\":[", first ? "" : ",", number, inode_type(inode), inode->i_mode,
+			inode->i_links_count, inode->i_size, inode->i_blocks, inode->i_mtime, inode->i_dtime);
+		block_walk_init(&walk, disk, inode, 0);
+		while (block_walk_next(&walk, &logical, &physical, &len)) {
+			if (!physical) continue;
+			out_printf(&out, "%s[%u,%u,%u]", run++ ? "," : "", logical, physical, len);
+		}
+		out_printf(&out, "]}");
+		first = 0;
+	}
+
+	first = 1;
+	out_printf(&out, "],\n\"tree\":[");
+	walk_tree(disk, json_entry, &first);
+	out_printf(&out, "]}\n");
+}
+
+void binary_record(unsigned int type, const void *data, size_t len, size_t extra) {
+	struct dump_record record = { type, DUMP_VERSION, len + extra };
+	out_write(&out, &record, sizeof(record));
+	out_write(&out, data, len);
+}
+
+void binary_entry(unsigned char *disk, unsigned int parent, const char *path, struct ext2_dir_entry_2 *entry, void *params) {
+	struct dump_entry record = { entry->inode, parent, entry->file_type, entry->name_len };
+	unsigned int padded = MULTIPLE_OF_FOUR(entry->name_len);
+	binary_record(DUMP_ENTRY, &record, sizeof(record), padded);
+	out_write(&out, entry->name, entry->name_len);
+	out_write(&out, "\0\0\0", padded - entry->name_len);
+}
+
+/*
+ * The binary dump, the same as the JSON one
+ */
+void dump_binary(unsigned char *disk) {
+	struct ext2_super_block *sb = EXT2_SUPER_BLOCK(disk);
+	unsigned int groups = EXT2_GROUP_COUNT(disk), group, number, logical, physical, len;
+	struct dump_run *runs = NULL;
+	unsigned int count, size = 0;
+	struct ext2_block_walk walk;
+
+	struct dump_super super = {
+		DUMP_MAGIC, EXT2_BLOCK_SIZE, sb->s_inodes_count, sb->s_blocks_count, sb->s_r_blocks_count,
+		sb->s_free_blocks_count, sb->s_free_inodes_count, sb->s_first_data_block, sb->s_blocks_per_group,
+		sb->s_inodes_per_group, EXT2_FIRST_INO(disk), EXT2_INODE_SIZE(disk), groups, sb->s_mtime, sb->s_wtime, sb->s_state
+	};
+	binary_record(DUMP_SUPER, &super, sizeof(super), 0);
+
+	for (group = 0; group < groups; group++) {
+		struct ext2_group_desc *desc = get_group_desc(disk, group);
+		unsigned int blocks = group_blocks(disk, group);
+		struct dump_group record = {
+			group, desc->bg_block_bitmap, desc->bg_inode_bitmap, desc->bg_inode_table,
+			desc->bg_free_blocks_count, desc->bg_free_inodes_count, desc->bg_used_dirs_count,
+			blocks - bitmap_used(EXT2_BLOCK(disk, desc->bg_block_bitmap), blocks),
+			sb->s_inodes_per_group - bitmap_used(EXT2_BLOCK(disk, desc->bg_inode_bitmap), sb->s_inodes_per_group)
+		};
+		binary_record(DUMP_GROUP, &record, sizeof(record), 0);
+	}
+
+	for (number = 1; number <= sb->s_inodes_count; number++) {
+		if (!inode_shown(disk, number)) continue;
+		struct ext2_inode *inode = get_inode(disk, number);
+
+		count = 0;
+		block_walk_init(&walk, disk, inode, 0);
+		while (block_walk_next(&walk, &logical, &physical, &len)) {
+			if (!physical) continue;
+			if (count == size) {
+				size = size ? size * 2 : 64;
+				runs = realloc(runs, size * sizeof(struct dump_run));
+				assert(runs);
+			}
+			runs[count].logical = logical;
+			runs[count].physical = physical;
+			runs[count].len = len;
+			count++;
+		}
+
+		struct dump_inode record = {
+			number, inode->i_mode, inode->i_links_count, inode->i_size,
+			inode->i_blocks, inode->i_mtime, inode->i_dtime, count
+		};
+		binary_record(DUMP_INODE, &record, sizeof(record), count * sizeof(struct dump_run));
+		out_write(&out, runs, count * sizeof(struct dump_run));
+	}
+	free(runs);
+
+	walk_tree(disk, binary_entry, NULL);
+	binary_record(DUMP_END, "", 0, 0);
+}
+
 int main(int argc, char **argv) {
+	argc = image_options(argc, argv);
+	int mode = DUMP_TEXT;
+
+	if (argc == 3 && !strcmp(argv[2], "--json")) {
+		mode = DUMP_JSON;
+	} else if (argc == 3 && !strcmp(argv[2], "--binary")) {
+		mode = DUMP_BINARY;
+	} else if (argc != 2) {
+		fprintf(stderr, usage, argv[0]);
+		return 1;
+	}
+
+	// Only reads, so it can look alongside other readers but not while it's written
+	unsigned char *disk = read_image(argv[1], EXT2_ACCESS_READ);
+	out_init(&out, STDOUT_FILENO);
+
+	if (mode == DUMP_JSON) {
+		dump_json(disk);
+	} else if (mode == DUMP_BINARY) {
+		dump_binary(disk);
+	} else {
+		bitmap_text_init();
+		dump_text(disk);
+	}
+	out_flush(&out);
 
-    if(argc != 2) {
-        fprintf(stderr, "Usage: %s <image file name>\n", argv[0]);
-        exit(1);
-    }
-    int fd = open(argv[1], O_RDWR);
-
-    disk = mmap(NULL, 128 * 1024, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    if(disk == MAP_FAILED) {
-        perror("mmap");
-        exit(1);
-    }
-
-    struct ext2_super_block *sb = (struct ext2_super_block *)(disk + 1024);
-    struct ext2_group_desc *blgrp = (struct ext2_group_desc *)( disk + 2048);
-
-
-
-
-    printf("Inodes: %d\n", sb->s_inodes_count);
-    printf("Blocks: %d\n", sb->s_blocks_count);
-    printf("Block group:\n");
-    printf("   block bitmap: %d\n", blgrp->bg_block_bitmap);
-    printf("   inode bitmap: %d\n", blgrp->bg_inode_bitmap);
-    printf("   inode table: %d\n", blgrp->bg_inode_table);
-    printf("   free blocks: %d\n", blgrp->bg_free_blocks_count);
-    printf("   free inodes: %d\n", blgrp->bg_free_inodes_count);
-    printf("   used dirs: %d\n", blgrp->bg_used_dirs_count);
-    
-
-    //ex 8 
-
-    int size =  sb->s_blocks_count/ 8;
-    printf("Block bitmap:");
-    unsigned char * bm = ( unsigned char * )(disk + EXT2_BLOCK_SIZE  * blgrp->bg_block_bitmap);
-    int i,x;    
-    unsigned char buf ;
-    for (i = 0; i < size; i++) {
-      printf(" ");
-      buf = *bm;
-      for (x = 0; x < 8; x++) {
-        printf("%d", (buf >> x) & 1);
-    }
-    bm++;
-    }
-    printf("\n");
-
-
-    printf("Inode bitmap:");
-    size =  sb->s_inodes_count/ 8;
-    unsigned char * im = ( unsigned char * )(disk + EXT2_BLOCK_SIZE  * blgrp->bg_inode_bitmap);    
-    for (i = 0; i < size; i++) {
-      printf(" ");
-      buf = *im;
-      for (x = 0; x < 8; x++) {
-        printf("%d", (buf >> x) & 1);
-    }
-    im++;
-    }
-    // set dir head to null
-    head = NULL;
-
-    printf("\n\n");
-    printf("Inodes:\n");
-    unsigned char  *itable = (unsigned char *)(disk + EXT2_BLOCK_SIZE * blgrp->bg_inode_table);
-    char type = '0';
-
-    for ( i = 1; i < sb->s_inodes_count; i++){
-        if( i > 2 && i < EXT2_GOOD_OLD_FIRST_INO){
-            continue;
-        }
-        struct ext2_inode * inode = (struct ext2_inode *) ( itable + sizeof(struct ext2_inode) * i);
-        if(inode->i_size == 0){
-            continue;
-        }
-
-        if ( inode->i_mode & EXT2_S_IFREG){
-            type = 'f';       
-        }else{
-            type = 'd';
-            if ( head == NULL){
-                head = malloc(sizeof(struct dir));
-                head->next = NULL;
-                head->in = inode;
-                head->inode_no = i;
-                last = head;
-            }
-            else{
-                last->next = malloc(sizeof(struct dir));
-                last = last->next;
-                last->next = NULL;
-                last->in = inode;
-                last->inode_no = i;  
-        
-            }
-        };
-        printf("[%d] type: %c size: %d links: %d blocks: %d\n", i + 1, type, inode->i_size, inode->i_links_count, inode->i_blocks);
-        int j;
-        printf("[%d] Blocks: ", i + 1);
-        int num_blocks = inode->i_blocks / 2;
-        for (j = 0; j < num_blocks; j++) {
-            if (j >= 12) {
-               break;
-            }
-            if(type == 'd'){
-                last->block_no = inode->i_block[j];
-            }
-         printf(" %d\n", inode->i_block[j]);
-        }
-
-    }
-
-
-
-    // ex9
-    printf("\n");
-    printf("Directory Blocks:\n");
-
-    while(head != NULL){
-      
-       printf("   DIR BLOCK NUM: %d (for inode %d)\n", head->block_no, head->inode_no +1);
-       head->d = (struct ext2_dir_entry_2 *)(disk + EXT2_BLOCK_SIZE * head->block_no);  
-
-        int i = 0;
-           while (i < EXT2_BLOCK_SIZE) {
-              i += head->d->rec_len;
-             type = '0';
-             if ((unsigned int) head->d->file_type == EXT2_FT_REG_FILE) {
-              type = 'f';
-                } 
-             else if((unsigned int) head->d->file_type == EXT2_FT_DIR) {
-               type = 'd';
-             }
-             printf("Inode: %d rec_len: %d name_len: %d type= %c name=%.*s\n", 
-             head->d->inode, head->d->rec_len, head->d->name_len, type, head->d->name_len, head->d->name);
-             head->d = (void *) head->d + head->d->rec_len;
-          }
-        struct dir *f = head;
-        head = head->next;
-        free(f);
-    }
-    
-    return 0;
+	if (out.error) {
+		fprintf(stderr, "stdout: %s\n", strerror(out.error));
+		return 1;
+	}
+	return 0;
 }
@@ -0,0 +1,26 @@
+#!/bin/sh
+# ext2_cp -r with more big files than it may have open at once. They're sparse,
+# so they're big enough to be left open for the writer but the image stays small
+set -e
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+disk="$dir/disk.img"
+files=120
+
+mkdir "$dir/tree"
+i=0
+while [ $i -lt $files ]; do
+	echo "file $i" > "$dir/tree/big$i"
+	truncate -s 1100K "$dir/tree/big$i"
+	i=$((i + 1))
+done
+mke2fs -q -t ext2 -b 1024 -N 256 "$disk" 4M
+
+(ulimit -n 64 && ./ext2_cp "$disk" -r "$dir/tree" /)
+
+./ext2_fsck "$disk"
+i=0
+while [ $i -lt $files ]; do
+	./ext2_cat "$disk" /tree/big$i | cmp - "$dir/tree/big$i"
+	i=$((i + 1))
+done
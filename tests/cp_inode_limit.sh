@@ -0,0 +1,30 @@
+#!/bin/sh
+# ext2_cp -r of a tree that takes every free inode there is. Each directory
+# takes one inode, . and .. are only links
+set -e
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+disk="$dir/disk.img"
+dirs=26
+
+# 64 inodes with 11 reserved and lost+found leaves 53: the tree, then a
+# directory and a file in it for each
+mkdir "$dir/tree"
+i=1
+while [ $i -le $dirs ]; do
+	mkdir "$dir/tree/d$i"
+	echo "file $i" > "$dir/tree/d$i/f"
+	i=$((i + 1))
+done
+mke2fs -q -t ext2 -b 1024 -N 64 "$disk" 1M
+
+./ext2_cp "$disk" -r "$dir/tree" /
+
+./ext2_fsck "$disk"
+e2fsck -fn "$disk"
+i=1
+while [ $i -le $dirs ]; do
+	./ext2_ls "$disk" -a /tree/d$i | grep -qx '\.\.'
+	./ext2_cat "$disk" /tree/d$i/f | cmp - "$dir/tree/d$i/f"
+	i=$((i + 1))
+done
@@ -0,0 +1,47 @@
+#!/bin/sh
+# ext2_defrag -p only moves things toward the front: the used space mustn't end
+# any later, and the biggest free extent mustn't shrink
+set -e
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+disk="$dir/disk.img"
+cp .backup/emptydisk.img "$disk"
+
+# The disk filled up to its end, and a file left in pieces in the gaps at the
+# front. Then the big one at the end goes, so the only run left is behind it
+i=1
+for size in 9000 3000 12000 2000 7000 72704; do
+	head -c $size /dev/urandom > "$dir/s$i"
+	./ext2_cp "$disk" "$dir/s$i" / >/dev/null
+	i=$((i + 1))
+done
+./ext2_rm "$disk" /s2
+./ext2_rm "$disk" /s4
+head -c 5000 /dev/urandom > "$dir/s7"
+./ext2_cp "$disk" "$dir/s7" / >/dev/null
+./ext2_rm "$disk" /s6
+
+# Last block in use, from the bitmap readimage prints. It pads it out to whole
+# bytes, and the first data block is 1 so there's one block less than it says
+last_used() {
+	blocks=$(./readimage "$1" | sed -n 's/^Blocks: //p')
+	./readimage "$1" | sed -n 's/^Block bitmap: //p' | tr -d ' ' | cut -c1-$((blocks - 1)) | sed 's/0*$//' | wc -c
+}
+largest_free() {
+	./ext2_frag "$1" | sed -n 's/^Free extents: .*largest \([0-9]*\) blocks.*/\1/p'
+}
+
+end_before=$(last_used "$disk")
+free_before=$(largest_free "$disk")
+./ext2_defrag "$disk" -p
+end_after=$(last_used "$disk")
+free_after=$(largest_free "$disk")
+
+echo "used space ends at $end_before -> $end_after, largest free extent $free_before -> $free_after"
+[ "$end_after" -le "$end_before" ]
+[ "$free_after" -ge "$free_before" ]
+
+./ext2_fsck "$disk"
+for i in 1 3 5 7; do
+	./ext2_cat "$disk" /s$i | cmp - "$dir/s$i"
+done
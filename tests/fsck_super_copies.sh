@@ -0,0 +1,21 @@
+#!/bin/sh
+# ext2_fsck knows where the superblock and descriptor copies are without the
+# block bitmap telling it, so one cleared from the bitmap is found and put back
+set -e
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+disk="$dir/disk.img"
+mke2fs -q -t ext2 -b 1024 "$disk" 64M
+
+# Group 1 starts at block 8193 with its superblock and descriptor copies,
+# clear their bits in its block bitmap
+bitmap=$(./readimage "$disk" --json | sed -n 's/.*{"group":1,"block_bitmap":\([0-9]*\),.*/\1/p')
+printf '\374' | dd of="$disk" bs=1 seek=$((bitmap * 1024)) conv=notrunc 2>/dev/null
+
+if ./ext2_fsck "$disk"; then
+	echo "cleared superblock copy not found"
+	exit 1
+fi
+./ext2_fsck "$disk" -y || [ $? -eq 1 ]
+./ext2_fsck "$disk"
+e2fsck -fn "$disk"
@@ -0,0 +1,18 @@
+#!/bin/sh
+# readimage's text dump of an image with every inode in use, the last one
+# included, is what the original readimage printed (readimage_full.txt)
+set -e
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+disk="$dir/disk.img"
+cp .backup/emptydisk.img "$disk"
+
+# 32 inodes, 11 reserved and lost+found
+i=1
+while [ $i -le 21 ]; do
+	echo "f$i" > "$dir/f$i"
+	./ext2_cp "$disk" "$dir/f$i" /
+	i=$((i + 1))
+done
+
+./readimage "$disk" | cmp - tests/readimage_full.txt
@@ -0,0 +1,37 @@
+#!/bin/sh
+# ext2_rm_bonus -r leaves the same image with one worker as with many, but
+# for the deletion times
+set -e
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+disk="$dir/disk.img"
+
+# A few levels of directories, files big enough for indirect blocks, and hard
+# links within the tree and from outside it
+mkdir "$dir/tree"
+for a in 1 2 3 4; do
+	for b in 1 2 3 4 5; do
+		mkdir -p "$dir/tree/a$a/b$b/c"
+		head -c $((a * b * 3000)) /dev/urandom > "$dir/tree/a$a/b$b/f"
+		echo "$a $b" > "$dir/tree/a$a/b$b/c/g"
+	done
+done
+mke2fs -q -t ext2 -b 1024 -N 256 "$disk" 4M
+./ext2_cp "$disk" -r "$dir/tree" / >/dev/null
+./ext2_ln "$disk" /tree/a1/link /tree/a4/b5/f
+./ext2_ln "$disk" /tree/a2/b2/c/link /tree/a3/b1/f
+./ext2_ln "$disk" /kept /tree/a2/b3/f
+cp "$disk" "$dir/many.img"
+
+./ext2_rm_bonus "$disk" -j 1 -r /tree
+./ext2_rm_bonus "$dir/many.img" -j 8 -r /tree
+./ext2_fsck "$disk"
+./ext2_cat "$disk" /kept | cmp - "$dir/tree/a2/b3/f"
+
+# Every byte that differs is in the i_dtime of an inode
+table=$(./readimage "$disk" | sed -n 's/^   inode table: //p')
+size=$(./readimage "$disk" --json | sed -n 's/.*"inode_size":\([0-9]*\).*/\1/p')
+cmp -l "$disk" "$dir/many.img" | awk -v start=$((table * 1024)) -v size="$size" '
+	{ offset = $1 - 1 - start }
+	offset < 0 || offset >= 256 * size || offset % size < 20 || offset % size >= 24 { bad++ }
+	END { if (bad) { print bad " bytes differ outside i_dtime"; exit 1 } }'